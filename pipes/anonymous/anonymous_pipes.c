@@ -5,6 +5,9 @@
 #include "sys/wait.h"
 #include "sys/types.h"
 
+/* Trace points, see ring_buffer_threads/trace_point.h */
+#include "trace_point.h"
+
 #define READ_END	0
 #define WRITE_END	1
 
@@ -22,6 +25,7 @@ void same_process(void)
 {
 	int pipe_fd[2];	/* 2 ends of the pipe */
 	char msg_buf[MSG_SIZE];
+	ssize_t ret;
 
 	printf("Process pid = %d\n", getpid());
 
@@ -34,11 +38,13 @@ void same_process(void)
 	memset(msg_buf, 0, MSG_SIZE);
 	/* Write message to pipe */
 	sprintf(msg_buf, "%s %d", msg, getpid());
-	write(pipe_fd[WRITE_END], &msg_buf, MSG_SIZE);
+	ret = write(pipe_fd[WRITE_END], &msg_buf, MSG_SIZE);
+	TRACE(TRACE_PIPE_WRITE, pipe_fd[WRITE_END], ret);
 
 	memset(msg_buf, 0, MSG_SIZE);
 	/* Read data from pipe */
-	read(pipe_fd[READ_END], &msg_buf, MSG_SIZE);
+	ret = read(pipe_fd[READ_END], &msg_buf, MSG_SIZE);
+	TRACE(TRACE_PIPE_READ, pipe_fd[READ_END], ret);
 
 	printf("[PID = %d] %s\n", getpid(), msg_buf);
 }
@@ -52,6 +58,7 @@ void different_processes(void)
 	int status;
 	pid_t pid;
 	char msg_buf[MSG_SIZE];
+	ssize_t ret;
 	
 	/* Create the pipe */
 	if (pipe(pipe_fd)) {
@@ -70,7 +77,8 @@ void different_processes(void)
 		printf("Child PID = %d\n", getpid());
 		/* child process read from pipe*/
 		close(pipe_fd[WRITE_END]);
-		read(pipe_fd[READ_END], &msg_buf, MSG_SIZE);
+		ret = read(pipe_fd[READ_END], &msg_buf, MSG_SIZE);
+		TRACE(TRACE_PIPE_READ, pipe_fd[READ_END], ret);
 		printf("[PID = %d] %s\n", getpid(), msg_buf);
 
 		exit(0);
@@ -79,7 +87,8 @@ void different_processes(void)
 		/* parent process write to pipe */
 		close(pipe_fd[READ_END]);
 		sprintf(msg_buf, "%s %d", msg, getpid());
-		write(pipe_fd[WRITE_END], &msg_buf, MSG_SIZE);
+		ret = write(pipe_fd[WRITE_END], &msg_buf, MSG_SIZE);
+		TRACE(TRACE_PIPE_WRITE, pipe_fd[WRITE_END], ret);
 	}
 	
 	/* wait for child process to finish */
@@ -92,6 +101,11 @@ int main()
 {
 	char test_no;
 
+#ifdef RING_TRACE
+	if (getenv("RING_TRACE_FILE"))
+		trace_start(getenv("RING_TRACE_FILE"));
+#endif
+
 	while(scanf("%c", &test_no)) {
 		fgetc(stdin);
 		switch(test_no) {
@@ -109,5 +123,8 @@ int main()
 		}
 	}
 exit:
+#ifdef RING_TRACE
+	trace_stop();
+#endif
 	return 0;
 }
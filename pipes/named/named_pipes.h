@@ -7,6 +7,9 @@
 #include "sys/stat.h"
 #include "sys/types.h"
 
+/* Trace points, see ring_buffer_threads/trace_point.h */
+#include "trace_point.h"
+
 #define PIPE	"/tmp/my_pipe"
 #define PERM	0666
 
@@ -11,6 +11,7 @@ void display_msg(struct pipe_msg p_msg)
 int read_from_pipe(struct pipe_msg *p_msg)
 {
 	int read_fd;
+	ssize_t ret;
 
 	if ((read_fd = open(PIPE, O_RDONLY)) == -1) {
 		fprintf(stderr, "Fail to open pipe for read [%d:%s]\n", errno,
@@ -20,7 +21,8 @@ int read_from_pipe(struct pipe_msg *p_msg)
 
 	/*flush structure first */
 	memset(p_msg, 0, sizeof(*p_msg));
-	read(read_fd, p_msg, sizeof(*p_msg));
+	ret = read(read_fd, p_msg, sizeof(*p_msg));
+	TRACE(TRACE_PIPE_READ, read_fd, ret);
 	close(read_fd);
 
 	return 0;
@@ -30,6 +32,7 @@ int read_from_pipe(struct pipe_msg *p_msg)
 int write_to_pipe(const struct pipe_msg *p_msg)
 {
 	int write_fd;
+	ssize_t ret;
 
 	if ((write_fd = open(PIPE, O_WRONLY)) == -1) {
 		fprintf(stderr, "Fail to open pipe for write [%d:%s]\n", errno,
@@ -37,7 +40,8 @@ int write_to_pipe(const struct pipe_msg *p_msg)
 		return -1;
 	}
 
-	write(write_fd, p_msg, sizeof(*p_msg));
+	ret = write(write_fd, p_msg, sizeof(*p_msg));
+	TRACE(TRACE_PIPE_WRITE, write_fd, ret);
 	close(write_fd);
 
 	return 0;
@@ -24,8 +24,16 @@ void start_communication(void)
 
 int main()
 {
+#ifdef RING_TRACE
+	if (getenv("RING_TRACE_FILE"))
+		trace_start(getenv("RING_TRACE_FILE"));
+#endif
+
 	/* Since server is running, pipe is created */
 	printf("Client starts with PID = %d\n", getpid());
 	start_communication();
+#ifdef RING_TRACE
+	trace_stop();
+#endif
 	return 0;
 }
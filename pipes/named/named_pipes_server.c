@@ -43,6 +43,11 @@ void start_communication(void)
 
 int main()
 {
+#ifdef RING_TRACE
+	if (getenv("RING_TRACE_FILE"))
+		trace_start(getenv("RING_TRACE_FILE"));
+#endif
+
 	/* Create the pipe */
 	if(mkfifo(PIPE, PERM)) {
 		fprintf(stderr, "Fail to create pipe [%d:%s]\n", errno, strerror(errno));
@@ -54,5 +59,8 @@ int main()
 
 	/* close the pipe */
 	unlink(PIPE);
+#ifdef RING_TRACE
+	trace_stop();
+#endif
 	return 0;
 }
@@ -0,0 +1,160 @@
+/* Broadcast ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "bcast_ring.h"
+
+static inline void *bcast_slot(struct bcast_ring *b_ring, unsigned int pos)
+{
+	return b_ring->slots + (pos & b_ring->mask) * b_ring->stride;
+}
+
+/*
+ * Init a broadcast ring buffer. Structure, slots and reader cursors are one
+ * allocation.
+ *
+ * @elem_size:	Sizeof elements
+ * @size:	Size of the buffer (power of 2)
+ * @nr_readers:	Number of readers, identified by 0..nr_readers - 1
+ */
+struct bcast_ring *bcast_ring_init(size_t elem_size, size_t size,
+				   unsigned int nr_readers)
+{
+	struct bcast_ring *b_ring;
+	size_t stride, slots;
+	unsigned int i;
+
+	if (!is_power_of_2(size) || !elem_size || !nr_readers) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	stride = ALIGN(elem_size, RING_SLOT_ALIGN);
+	slots = ALIGN(size * stride, CACHE_LINE);
+	if (posix_memalign((void **)&b_ring, CACHE_LINE, sizeof(*b_ring) + slots +
+			   nr_readers * sizeof(struct bcast_cursor))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+
+	b_ring->elem_size = elem_size;
+	b_ring->size = size;
+	b_ring->stride = stride;
+	b_ring->mask = size - 1;
+	b_ring->nr_readers = nr_readers;
+	b_ring->readers = (struct bcast_cursor *)(b_ring->slots + slots);
+	b_ring->head = b_ring->min_tail = 0;
+	for (i = 0; i < nr_readers; i++)
+		b_ring->readers[i].tail = b_ring->readers[i].head_cache = 0;
+
+	return b_ring;
+out_err:
+	return NULL;
+}
+
+/*
+ * Free a broadcast ring buffer.
+ */
+void bcast_ring_free(struct bcast_ring *b_ring)
+{
+	free(b_ring);
+}
+
+/*
+ * Return the address of the next free slot, NULL if the slowest reader is
+ * a whole ring behind (buffer FULL).
+ */
+void *bcast_ring_reserve(struct bcast_ring *b_ring)
+{
+	unsigned int i, tail, min, head = b_ring->head;
+
+	if (head - b_ring->min_tail == b_ring->size) {
+		/* look for the slowest reader */
+		min = head;
+		for (i = 0; i < b_ring->nr_readers; i++) {
+			tail = smp_load_acquire(&b_ring->readers[i].tail);
+			if ((int)(tail - min) < 0)
+				min = tail;
+		}
+		b_ring->min_tail = min;
+		if (head - min == b_ring->size)
+			return NULL;
+	}
+
+	return bcast_slot(b_ring, head);
+}
+
+/*
+ * Publish the slot returned by bcast_ring_reserve to all the readers.
+ */
+void bcast_ring_commit(struct bcast_ring *b_ring)
+{
+	smp_store_release(&b_ring->head, b_ring->head + 1);
+}
+
+/*
+ * Return the address of the oldest element reader did not see yet, NULL if
+ * it has seen all of them (buffer EMPTY for this reader).
+ */
+void *bcast_ring_peek(struct bcast_ring *b_ring, unsigned int reader)
+{
+	struct bcast_cursor *cursor = &b_ring->readers[reader];
+
+	if (cursor->head_cache == cursor->tail) {
+		cursor->head_cache = smp_load_acquire(&b_ring->head);
+		if (cursor->head_cache == cursor->tail)
+			return NULL;
+	}
+
+	return bcast_slot(b_ring, cursor->tail);
+}
+
+/*
+ * Move reader past the element returned by bcast_ring_peek.
+ */
+void bcast_ring_release(struct bcast_ring *b_ring, unsigned int reader)
+{
+	struct bcast_cursor *cursor = &b_ring->readers[reader];
+
+	smp_store_release(&cursor->tail, cursor->tail + 1);
+}
+
+/*
+ * Add an element for all the readers.
+ *
+ * If the slowest reader did not make room (buffer FULL), -1 is returned and
+ * the element is not added. On success, 0 is returned.
+ */
+int bcast_ring_put(struct bcast_ring *b_ring, void *elem)
+{
+	void *slot;
+
+	slot = bcast_ring_reserve(b_ring);
+	if (!slot)
+		return -1;
+
+	memcpy(slot, elem, b_ring->elem_size);
+	bcast_ring_commit(b_ring);
+
+	return 0;
+}
+
+/*
+ * Extract the next element for reader.
+ *
+ * If reader has seen all the elements, -1 is returned. On success, 0 is
+ * returned.
+ */
+int bcast_ring_get(struct bcast_ring *b_ring, unsigned int reader, void *elem)
+{
+	void *slot;
+
+	slot = bcast_ring_peek(b_ring, reader);
+	if (!slot)
+		return -1;
+
+	memcpy(elem, slot, b_ring->elem_size);
+	bcast_ring_release(b_ring, reader);
+
+	return 0;
+}
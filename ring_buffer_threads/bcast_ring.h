@@ -0,0 +1,49 @@
+/* Broadcast ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * One writer, several independent readers. Every reader has its own read
+ * cursor and sees every element, the element is stored only once. A slot
+ * is reused only after the slowest reader went past it.
+ */
+#ifndef __BCAST_RING_H__
+#define __BCAST_RING_H__
+
+#include "buffer.h"
+
+/* Reader position, written only by its reader */
+struct bcast_cursor {
+	unsigned int		tail;		/* next element to read */
+	unsigned int		head_cache;	/* reader copy of head */
+} __cacheline_aligned;
+
+/*
+ * The writer reloads the readers tails only when the ring looks full (the
+ * slowest one, min_tail, says so), a reader reloads head only when its
+ * cached copy says the ring is empty.
+ */
+struct bcast_ring {
+	size_t			elem_size;	/* sizeof elements in buffer */
+	size_t			size;		/* size of buffer (power of 2) */
+	size_t			stride;		/* distance between slots */
+	unsigned int		mask;		/* size - 1 */
+	unsigned int		nr_readers;
+	struct bcast_cursor	*readers;	/* after the slots */
+	/* producer side */
+	unsigned int		head __cacheline_aligned;
+	unsigned int		min_tail;	/* slowest reader, cached */
+	/* slot arena */
+	char			slots[] __cacheline_aligned;
+};
+
+struct bcast_ring *bcast_ring_init(size_t elem_size, size_t size,
+				   unsigned int nr_readers);
+void bcast_ring_free(struct bcast_ring *b_ring);
+int bcast_ring_put(struct bcast_ring *b_ring, void *elem);
+int bcast_ring_get(struct bcast_ring *b_ring, unsigned int reader, void *elem);
+/* Zero copy */
+void *bcast_ring_reserve(struct bcast_ring *b_ring);
+void bcast_ring_commit(struct bcast_ring *b_ring);
+void *bcast_ring_peek(struct bcast_ring *b_ring, unsigned int reader);
+void bcast_ring_release(struct bcast_ring *b_ring, unsigned int reader);
+
+#endif /* __BCAST_RING_H__ */
@@ -2,43 +2,205 @@
  * Copyright (C) 2020 Lazar Razvan
  */
 
+#include "unistd.h"
+#include "limits.h"
+#include "poll.h"
+#include "sys/eventfd.h"
 #include "buffer.h"
+#include "futex.h"
+
+/* Shard of the calling thread, given round robin on first use */
+static __thread unsigned int ring_shard = ~0U;
+static unsigned int ring_next_shard;
+
+/*
+ * Return the shard (0..RING_SHARDS - 1) of the calling thread. Per thread
+ * data split in RING_SHARDS cache lines is indexed with it, threads only
+ * share a shard when there are more than RING_SHARDS of them.
+ */
+unsigned int ring_thread_shard(void)
+{
+	if (unlikely(ring_shard == ~0U))
+		ring_shard = __atomic_fetch_add(&ring_next_shard, 1,
+					__ATOMIC_RELAXED) % RING_SHARDS;
+
+	return ring_shard;
+}
+
+static inline struct hist *ring_dwell(struct ring_buffer *r_buffer)
+{
+	return &r_buffer->dwell[ring_thread_shard()].hist;
+}
+
+#ifdef RING_STATS
+static inline struct ring_stats_shard *ring_stats_shard(struct ring_buffer *r_buffer)
+{
+	return &r_buffer->stats[ring_thread_shard()];
+}
+
+/* Relaxed atomic, two threads may share a shard */
+#define ring_stat_add(r, field, n) \
+do { \
+	if ((r)->stats) \
+		__atomic_fetch_add(&ring_stats_shard(r)->field, (n), \
+				   __ATOMIC_RELAXED); \
+} while (0)
+
+/*
+ * Occupancy is only sampled where the producer already knows it: SPSC tail
+ * refresh, default mode under the lock, once a lap in MPMC and overwrite
+ * mode, and FULL. The put fast path never reads the consumer's line. The
+ * MPMC and overwrite heads count claimed positions, hence the cap.
+ */
+#define ring_stat_hwm(r, occupancy) \
+do { \
+	if ((r)->stats) { \
+		struct ring_stats_shard *__sh = ring_stats_shard(r); \
+		unsigned int __occ = (occupancy); \
+		if (__occ > (r)->size) \
+			__occ = (r)->size; \
+		if (__occ > READ_ONCE(__sh->hwm)) \
+			WRITE_ONCE(__sh->hwm, __occ); \
+	} \
+} while (0)
+#else
+#define ring_stat_add(r, field, n)	do { } while (0)
+#define ring_stat_hwm(r, occupancy)	do { } while (0)
+#endif
+
+/* pos..pos + n - 1 holds the first position of a lap (HWM sampling) */
+static inline int ring_lap_start(struct ring_buffer *r_buffer, unsigned int pos,
+				 unsigned int n)
+{
+	return ((pos - 1) & r_buffer->mask) + n >= r_buffer->size;
+}
+
+/* Eventfd states (RING_F_EVENTFD) */
+#define RING_SIGNALED	0	/* eventfd written, or may be */
+#define RING_ARMED	1	/* eventfd clear, next put writes it */
+#define RING_ARMING	2	/* a reader is clearing the eventfd */
+
+/*
+ * Overwrite mode slot seq, four values per position: writer of pos copying,
+ * pos dropped while an older writer is still copying, pos dropped, element
+ * of pos stored. A slot is in use by a writer in the first two states.
+ */
+#define RING_OW_BUSY(pos)	(4 * (unsigned int)(pos) + 1)
+#define RING_OW_SKIPPING(pos)	(4 * (unsigned int)(pos) + 2)
+#define RING_OW_SKIPPED(pos)	(4 * (unsigned int)(pos) + 3)
+#define RING_OW_DONE(pos)	(4 * (unsigned int)(pos) + 4)
+#define RING_OW_COPYING(seq)	((((seq) - 1) & 3) < 2)
+
+/*
+ * Take r_mutex, counting the times somebody else had it.
+ */
+static inline void ring_buffer_lock(struct ring_buffer *r_buffer)
+{
+#ifdef MULTI_THREADING
+	if (pthread_mutex_trylock(&r_buffer->r_mutex)) {
+		ring_stat_add(r_buffer, contended, 1);
+		pthread_mutex_lock(&r_buffer->r_mutex);
+	}
+#endif
+}
 
 /*
  * Init a ring buffer.
  *
- * @buffer:	Buffer from client
+ * The ring structure and all the slots are one aligned allocation: the
+ * slots follow the structure and are stride bytes apart, stride being the
+ * slot header (if the mode needs one) plus elem_size, rounded up. The
+ * statistics shards (RING_F_STATS) follow the slots.
+ *
  * @elem_size:	Sizeof elements
- * @size:	Size of the buffer
+ * @size:	Size of the buffer (power of 2, indexes wrap around)
+ * @flags:	RING_F_* flags
  */
-struct ring_buffer * ring_buffer_init(size_t elem_size, size_t size)
+struct ring_buffer * ring_buffer_init_flags(size_t elem_size, size_t size,
+					    unsigned int flags)
 {
-	int i;
+	unsigned int i;
+	size_t hdr, stride, stats = 0, dwell = 0;
 	struct ring_buffer *r_buffer;
 
-	r_buffer = (struct ring_buffer *) malloc(sizeof(*r_buffer));
-	if (!r_buffer) {
-		ON_ERR(errno);
+	if (!is_power_of_2(size) || !elem_size) {
+		ON_ERR(EINVAL);
 		goto out_err;
 	}
 
-	r_buffer->buffer = (void **) malloc(size * sizeof(void*));
-	if (!r_buffer->buffer) {
-		ON_ERR(errno);
-		goto out_err_1;
+	hdr = (flags & (RING_F_MPMC | RING_F_OVERWRITE)) ?
+		ALIGN(sizeof(struct ring_slot), RING_SLOT_ALIGN) : 0;
+	/* the timestamp is the end of the header, right before the element */
+	if (flags & RING_F_TSTAMP) {
+		hdr += sizeof(unsigned long long);
+		dwell = CACHE_LINE + RING_SHARDS * sizeof(struct ring_dwell_shard);
 	}
-	for (i = 0; i < size; i++) {
-		r_buffer->buffer[i] = (void *) malloc(elem_size);
-		if (!r_buffer->buffer[i]) {
-			ON_ERR(errno);
-			goto out_err_2;
-		}
+	stride = ALIGN(hdr + elem_size, RING_SLOT_ALIGN);
+	if (flags & RING_F_CACHE_ALIGN)
+		stride = ALIGN(stride, CACHE_LINE);
+#ifdef RING_STATS
+	/* shards go after the slots, on their own cache lines */
+	if (flags & RING_F_STATS)
+		stats = CACHE_LINE + RING_SHARDS * sizeof(struct ring_stats_shard);
+#endif
+	if (size > (~(size_t)0 - sizeof(*r_buffer) - stats - dwell) / stride) {
+		ON_ERR(EOVERFLOW);
+		goto out_err;
+	}
+
+	/* head and tail are on their own cache lines, slots start on a new one */
+	if (posix_memalign((void **)&r_buffer, CACHE_LINE,
+			   sizeof(*r_buffer) + size * stride + stats + dwell)) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+
+	r_buffer->stats = NULL;
+	if (stats) {
+		r_buffer->stats = (struct ring_stats_shard *)(r_buffer->slots +
+				ALIGN(size * stride, CACHE_LINE));
+		memset(r_buffer->stats, 0, RING_SHARDS *
+		       sizeof(struct ring_stats_shard));
+	}
+	r_buffer->dwell = NULL;
+	if (dwell) {
+		r_buffer->dwell = (struct ring_dwell_shard *)(r_buffer->slots +
+				ALIGN(size * stride, CACHE_LINE) + (stats ?
+				RING_SHARDS * sizeof(struct ring_stats_shard) : 0));
+		for (i = 0; i < RING_SHARDS; i++)
+			hist_init(&r_buffer->dwell[i].hist);
 	}
 
 	r_buffer->elem_size = elem_size;
 	r_buffer->size = size;
-	r_buffer->head = 0;
-	r_buffer->tail = 0;
+	r_buffer->stride = stride;
+	r_buffer->hdr = hdr;
+	r_buffer->mask = size - 1;
+	r_buffer->flags = flags;
+	r_buffer->closed = 0;
+	r_buffer->head = r_buffer->tail_cache = 0;
+	r_buffer->tail = r_buffer->head_cache = 0;
+	r_buffer->put_event = r_buffer->get_event = 0;
+	r_buffer->readers_waiting = r_buffer->writers_waiting = 0;
+	r_buffer->spin = RING_SPIN_MIN;
+	r_buffer->efd = -1;
+	r_buffer->armed = RING_ARMED;
+
+	/* slot i is free for the writer of position i */
+	if (flags & RING_F_MPMC)
+		for (i = 0; i < size; i++)
+			ring_slot(r_buffer, i)->seq = i;
+	/* slot i holds the (never written) element of position i - size */
+	if (flags & RING_F_OVERWRITE)
+		for (i = 0; i < size; i++)
+			ring_slot(r_buffer, i)->seq = RING_OW_DONE(i - size);
+	if (flags & RING_F_EVENTFD) {
+		r_buffer->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (r_buffer->efd < 0) {
+			ON_ERR(errno);
+			goto out_err_1;
+		}
+	}
 #ifdef MULTI_THREADING
 	if (pthread_mutex_init(&r_buffer->r_mutex, NULL)) {
 		ON_ERR(errno);
@@ -47,100 +209,1306 @@ struct ring_buffer * ring_buffer_init(size_t elem_size, size_t size)
 #endif
 
 	return r_buffer;
+#ifdef MULTI_THREADING
 out_err_2:
-	for (i = i-1; i >= 0; i--)
-		free(r_buffer->buffer[i]);
-	free(r_buffer->buffer);
+	if (r_buffer->efd >= 0)
+		close(r_buffer->efd);
+#endif
 out_err_1:
 	free(r_buffer);
 out_err:
 	return NULL;
 }
 
+/*
+ * Init a ring buffer using the default mode (RING_DEFAULT_FLAGS).
+ *
+ * @elem_size:	Sizeof elements
+ * @size:	Size of the buffer
+ */
+struct ring_buffer * ring_buffer_init(size_t elem_size, size_t size)
+{
+	return ring_buffer_init_flags(elem_size, size, RING_DEFAULT_FLAGS);
+}
+
 /*
  * Flush a ring buffer
  */
 void ring_buffer_free(struct ring_buffer *r_buffer)
 {
-	int i;
-
 	if (r_buffer) {
 #ifdef MULTI_THREADING
 		if (pthread_mutex_destroy(&r_buffer->r_mutex))
 			ON_ERR(errno);
 #endif
-		for (i = 0; i < r_buffer->size; i++)
-			free(r_buffer->buffer[i]);
-		free(r_buffer->buffer);
+		if (r_buffer->efd >= 0)
+			close(r_buffer->efd);
 		free(r_buffer);
 		r_buffer = NULL;
 	}
 }
 
 /*
- * Add an element in ring buffer.
+ * Wake up to n threads sleeping on event, if there are any. The full barrier
+ * orders the publish of the elements before the read of waiting, it pairs
+ * with the one in ring_buffer_wait (increment of waiting before the last
+ * check of the ring).
+ */
+static void ring_buffer_wake(unsigned int *waiting, unsigned int *event,
+			     unsigned int n)
+{
+	smp_mb();
+	if (likely(!READ_ONCE(*waiting)))
+		return;
+
+	__atomic_fetch_add(event, 1, __ATOMIC_RELEASE);
+	futex_wake(event, n);
+}
+
+/*
+ * Signal the eventfd if a reader armed it. The full barrier orders the
+ * publish of the elements before the read of armed, it pairs with the one
+ * in ring_buffer_arm.
+ */
+static void ring_buffer_notify(struct ring_buffer *r_buffer)
+{
+	unsigned long long one = 1;
+	unsigned int armed = RING_ARMED;
+
+	smp_mb();
+	if (likely(READ_ONCE(r_buffer->armed) != RING_ARMED))
+		return;
+
+	/* only one writer pays for the system call */
+	if (__atomic_compare_exchange_n(&r_buffer->armed, &armed, RING_SIGNALED,
+					0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) &&
+	    write(r_buffer->efd, &one, sizeof(one)) != sizeof(one))
+		ON_ERR(errno);
+}
+
+/*
+ * The ring was seen EMPTY: make the next put signal the eventfd. Nothing
+ * to do if it is already armed (the eventfd is clear) or being armed by
+ * another reader. Otherwise consume the pending signal, arm, and look
+ * again: a put that raced with us saw it was not armed and did not signal.
+ */
+static void ring_buffer_arm(struct ring_buffer *r_buffer)
+{
+	unsigned int armed = RING_SIGNALED;
+	unsigned long long cnt;
+
+	if (!(r_buffer->flags & RING_F_EVENTFD) ||
+	    READ_ONCE(r_buffer->closed) ||
+	    READ_ONCE(r_buffer->armed) != RING_SIGNALED ||
+	    !__atomic_compare_exchange_n(&r_buffer->armed, &armed, RING_ARMING,
+					 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	if (read(r_buffer->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		ON_ERR(errno);
+	__atomic_store_n(&r_buffer->armed, RING_ARMED, __ATOMIC_SEQ_CST);
+	/* pairs with ring_buffer_notify: the store is visible before the
+	 * count and closed loads (relaxed/acquire, they could move above it)
+	 */
+	smp_mb();
+	if (ring_buffer_count(r_buffer) || READ_ONCE(r_buffer->closed))
+		ring_buffer_notify(r_buffer);
+}
+
+static inline void ring_buffer_wake_readers(struct ring_buffer *r_buffer,
+					    unsigned int n)
+{
+	if (r_buffer->flags & RING_F_EVENTFD)
+		ring_buffer_notify(r_buffer);
+	if (r_buffer->flags & RING_F_WAIT)
+		ring_buffer_wake(&r_buffer->readers_waiting,
+				 &r_buffer->put_event, n);
+}
+
+static inline void ring_buffer_wake_writers(struct ring_buffer *r_buffer,
+					    unsigned int n)
+{
+	if (r_buffer->flags & RING_F_WAIT)
+		ring_buffer_wake(&r_buffer->writers_waiting,
+				 &r_buffer->get_event, n);
+}
+
+/*
+ * Mark the end of the stream. Call it once the producers are done: the
+ * elements already in the ring are still delivered, then get returns
+ * RING_CLOSED (get_wait too, instead of sleeping) and put on a FULL ring
+ * returns RING_CLOSED. All the threads sleeping in ring_buffer_*_wait are
+ * woken up and the eventfd (RING_F_EVENTFD) stays readable.
+ */
+void ring_buffer_close(struct ring_buffer *r_buffer)
+{
+	unsigned long long one = 1;
+
+	/* the elements put before are visible to whoever sees closed */
+	__atomic_store_n(&r_buffer->closed, 1, __ATOMIC_SEQ_CST);
+
+	if (r_buffer->flags & RING_F_EVENTFD) {
+		__atomic_store_n(&r_buffer->armed, RING_SIGNALED, __ATOMIC_SEQ_CST);
+		if (write(r_buffer->efd, &one, sizeof(one)) != sizeof(one))
+			ON_ERR(errno);
+	}
+
+	if (r_buffer->flags & RING_F_WAIT) {
+		ring_buffer_wake(&r_buffer->readers_waiting,
+				 &r_buffer->put_event, INT_MAX);
+		ring_buffer_wake(&r_buffer->writers_waiting,
+				 &r_buffer->get_event, INT_MAX);
+	}
+}
+
+/*
+ * SPSC reserve. Only the producer writes head, only the consumer writes tail.
  *
- * Please note that if the buffer is FULL, -1 is returned and the element
- * is not added. On success, 0 is returned.
+ * tail is reloaded only when the cached copy says the ring is full.
  */
-int ring_buffer_put(struct ring_buffer *r_buffer, void *elem)
+static void *ring_buffer_reserve_spsc(struct ring_buffer *r_buffer)
 {
+	unsigned int head = r_buffer->head;
+
+	if (head - r_buffer->tail_cache == r_buffer->size) {
+		r_buffer->tail_cache = smp_load_acquire(&r_buffer->tail);
+		if (head - r_buffer->tail_cache == r_buffer->size)
+			return NULL;
+		ring_stat_hwm(r_buffer, head - r_buffer->tail_cache + 1);
+	}
+
+	return ring_slot_data(r_buffer, head);
+}
+
+/*
+ * SPSC commit. The slot is filled before head is released, so a consumer
+ * that acquires the new head also sees the element.
+ */
+static void ring_buffer_commit_spsc(struct ring_buffer *r_buffer)
+{
+	smp_store_release(&r_buffer->head, r_buffer->head + 1);
+}
+
+/*
+ * SPSC peek. Mirror of ring_buffer_reserve_spsc.
+ */
+static void *ring_buffer_peek_spsc(struct ring_buffer *r_buffer)
+{
+	unsigned int tail = r_buffer->tail;
+
+	if (r_buffer->head_cache == tail) {
+		r_buffer->head_cache = smp_load_acquire(&r_buffer->head);
+		if (r_buffer->head_cache == tail)
+			return NULL;
+	}
 
+	return ring_slot_data(r_buffer, tail);
+}
+
+/*
+ * SPSC release. The slot is read before tail is released, so the producer
+ * can't overwrite it while it is still in use.
+ */
+static void ring_buffer_release_spsc(struct ring_buffer *r_buffer)
+{
+	smp_store_release(&r_buffer->tail, r_buffer->tail + 1);
+}
+
+/*
+ * MPMC reserve (bounded queue with per slot sequence numbers).
+ *
+ * A writer owns position pos once it moves head from pos to pos + 1 with a
+ * CAS, and it may only do that while the slot seq == pos (slot consumed by
+ * the reader of the previous lap). A smaller seq means the ring is full.
+ */
+static void *ring_buffer_reserve_mpmc(struct ring_buffer *r_buffer)
+{
+	unsigned int pos, seq;
+	int diff;
+
+	pos = READ_ONCE(r_buffer->head);
+	for (;;) {
+		seq = smp_load_acquire(&ring_slot(r_buffer, pos)->seq);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			/* on failure pos is updated with the current head */
+			if (__atomic_compare_exchange_n(&r_buffer->head, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+			ring_stat_add(r_buffer, contended, 1);
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			/* another writer took pos */
+			pos = READ_ONCE(r_buffer->head);
+		}
+	}
+
+	if (ring_lap_start(r_buffer, pos, 1))
+		ring_stat_hwm(r_buffer, pos + 1 - READ_ONCE(r_buffer->tail));
+
+	return ring_slot_data(r_buffer, pos);
+}
+
+/*
+ * MPMC commit. The slot seq is still pos, seq = pos + 1 hands the slot to
+ * the reader of position pos.
+ */
+static void ring_buffer_commit_mpmc(struct ring_buffer *r_buffer, void *elem)
+{
+	struct ring_slot *slot;
+
+	slot = (struct ring_slot *)((char *)elem - r_buffer->hdr);
+	smp_store_release(&slot->seq, slot->seq + 1);
+}
+
+/*
+ * MPMC peek. A reader may claim position pos while the slot seq == pos + 1.
+ */
+static void *ring_buffer_peek_mpmc(struct ring_buffer *r_buffer)
+{
+	unsigned int pos, seq;
+	int diff;
+
+	pos = READ_ONCE(r_buffer->tail);
+	for (;;) {
+		seq = smp_load_acquire(&ring_slot(r_buffer, pos)->seq);
+		diff = (int)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r_buffer->tail, &pos,
+						pos + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+			ring_stat_add(r_buffer, contended, 1);
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = READ_ONCE(r_buffer->tail);
+		}
+	}
+
+	return ring_slot_data(r_buffer, pos);
+}
+
+/*
+ * MPMC release. The slot seq is pos + 1, give it back to the writer of the
+ * next lap with seq = pos + size.
+ */
+static void ring_buffer_release_mpmc(struct ring_buffer *r_buffer, void *elem)
+{
+	struct ring_slot *slot;
+
+	slot = (struct ring_slot *)((char *)elem - r_buffer->hdr);
+	smp_store_release(&slot->seq, slot->seq - 1 + r_buffer->size);
+}
+
+/*
+ * Default mode reserve. r_mutex stays held until commit.
+ */
+static void *ring_buffer_reserve_lock(struct ring_buffer *r_buffer)
+{
 	if (r_buffer->head - r_buffer->tail == r_buffer->size)
-		return -1;
+		return NULL;
 
 #ifdef MULTI_THREADING
-	pthread_mutex_lock(&r_buffer->r_mutex);
+	ring_buffer_lock(r_buffer);
 	/* double check locking */
 	if (r_buffer->head - r_buffer->tail == r_buffer->size) {
 		pthread_mutex_unlock(&r_buffer->r_mutex);
-		return -1;
+		return NULL;
 	}
 #endif
 
-	memcpy(r_buffer->buffer[r_buffer->head % r_buffer->size], elem, r_buffer->elem_size);
-	++r_buffer->head;
+	ring_stat_hwm(r_buffer, r_buffer->head - r_buffer->tail + 1);
+	return ring_slot_data(r_buffer, r_buffer->head);
+}
+
+/*
+ * Default mode peek. r_mutex stays held until release.
+ */
+static void *ring_buffer_peek_lock(struct ring_buffer *r_buffer)
+{
+	if (r_buffer->head - r_buffer->tail == 0)
+		return NULL;
 
 #ifdef MULTI_THREADING
-	pthread_mutex_unlock(&r_buffer->r_mutex);
+	ring_buffer_lock(r_buffer);
+	/* double check locking */
+	if (r_buffer->head - r_buffer->tail == 0) {
+		pthread_mutex_unlock(&r_buffer->r_mutex);
+		return NULL;
+	}
 #endif
+
+	return ring_slot_data(r_buffer, r_buffer->tail);
+}
+
+/*
+ * Reserve the next free slot and return its address, the caller writes the
+ * element straight into it and calls ring_buffer_commit. If the buffer is
+ * FULL, NULL is returned.
+ *
+ * In the default mode r_mutex (MULTI_THREADING) is held from reserve until
+ * commit, keep the window short. In SPSC mode only one slot can be reserved
+ * at a time. Not available in overwrite mode (NULL, errno EINVAL): a slot
+ * handed out could be overwritten while in use.
+ */
+void *ring_buffer_reserve(struct ring_buffer *r_buffer)
+{
+	void *slot;
+
+	if (unlikely(r_buffer->flags & RING_F_OVERWRITE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (r_buffer->flags & RING_F_SPSC)
+		slot = ring_buffer_reserve_spsc(r_buffer);
+	else if (r_buffer->flags & RING_F_MPMC)
+		slot = ring_buffer_reserve_mpmc(r_buffer);
+	else
+		slot = ring_buffer_reserve_lock(r_buffer);
+
+	if (!slot) {
+		ring_stat_add(r_buffer, full, 1);
+		ring_stat_hwm(r_buffer, r_buffer->size);
+	}
+	return slot;
+}
+
+/*
+ * Publish a slot returned by ring_buffer_reserve.
+ */
+void ring_buffer_commit(struct ring_buffer *r_buffer, void *elem)
+{
+	if (r_buffer->flags & RING_F_TSTAMP)
+		*ring_slot_tstamp(elem) = ring_clock();
+
+	ring_stat_add(r_buffer, puts, 1);
+
+	if (r_buffer->flags & RING_F_SPSC) {
+		ring_buffer_commit_spsc(r_buffer);
+	} else if (r_buffer->flags & RING_F_MPMC) {
+		ring_buffer_commit_mpmc(r_buffer, elem);
+	} else {
+		++r_buffer->head;
+#ifdef MULTI_THREADING
+		pthread_mutex_unlock(&r_buffer->r_mutex);
+#endif
+	}
+
+	ring_buffer_wake_readers(r_buffer, 1);
+}
+
+/*
+ * Return the address of the oldest element, the caller reads it in place
+ * and calls ring_buffer_release. If the buffer is EMPTY, NULL is returned.
+ *
+ * Same locking rules as ring_buffer_reserve.
+ */
+static inline void *__ring_buffer_peek(struct ring_buffer *r_buffer)
+{
+	if (r_buffer->flags & RING_F_SPSC)
+		return ring_buffer_peek_spsc(r_buffer);
+	if (r_buffer->flags & RING_F_MPMC)
+		return ring_buffer_peek_mpmc(r_buffer);
+	return ring_buffer_peek_lock(r_buffer);
+}
+
+void *ring_buffer_peek(struct ring_buffer *r_buffer)
+{
+	void *slot;
+
+	if (unlikely(r_buffer->flags & RING_F_OVERWRITE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	slot = __ring_buffer_peek(r_buffer);
+	if (!slot) {
+		ring_stat_add(r_buffer, empty, 1);
+		ring_buffer_arm(r_buffer);
+	}
+	return slot;
+}
+
+/*
+ * Give back to the writers a slot returned by ring_buffer_peek.
+ */
+void ring_buffer_release(struct ring_buffer *r_buffer, void *elem)
+{
+	/* before the slot goes back to the writers */
+	if (r_buffer->flags & RING_F_TSTAMP)
+		hist_add(ring_dwell(r_buffer), ring_clock() -
+			 *ring_slot_tstamp(elem));
+
+	ring_stat_add(r_buffer, gets, 1);
+
+	if (r_buffer->flags & RING_F_SPSC) {
+		ring_buffer_release_spsc(r_buffer);
+	} else if (r_buffer->flags & RING_F_MPMC) {
+		ring_buffer_release_mpmc(r_buffer, elem);
+	} else {
+		++r_buffer->tail;
+#ifdef MULTI_THREADING
+		pthread_mutex_unlock(&r_buffer->r_mutex);
+#endif
+	}
+
+	ring_buffer_wake_writers(r_buffer, 1);
+}
+
+/*
+ * Overwrite mode put. Take the next position and write its slot, whatever
+ * the readers did with the element that was there. The element is dropped
+ * when the slot already belongs to a newer position or when a writer of an
+ * older position is still copying into it (the ring wrapped during its
+ * copy): waiting for it is not an option. The drop is left in the slot
+ * (SKIPPING, SKIPPED once the older writer is done), so readers of pos
+ * count it as missed instead of waiting for an element that never comes.
+ * Readers account for every lost position, writers don't count them.
+ */
+static void ring_buffer_put_ow(struct ring_buffer *r_buffer, void *elem)
+{
+	struct ring_slot *slot;
+	unsigned int pos, seq;
+
+	pos = __atomic_fetch_add(&r_buffer->head, 1, __ATOMIC_RELAXED);
+	slot = ring_slot(r_buffer, pos);
+	if (ring_lap_start(r_buffer, pos, 1))
+		ring_stat_hwm(r_buffer, pos + 1 - READ_ONCE(r_buffer->tail));
+
+	seq = READ_ONCE(slot->seq);
+	for (;;) {
+		if ((int)(seq - RING_OW_BUSY(pos)) >= 0)
+			/* pos already reads as overwritten */
+			return;
+		if (RING_OW_COPYING(seq)) {
+			if (__atomic_compare_exchange_n(&slot->seq, &seq,
+					RING_OW_SKIPPING(pos), 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&slot->seq, &seq, RING_OW_BUSY(pos),
+						1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	/* readers seeing the new element see BUSY first */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)slot + r_buffer->hdr, elem, r_buffer->elem_size);
+	if (r_buffer->flags & RING_F_TSTAMP)
+		*ring_slot_tstamp((char *)slot + r_buffer->hdr) = ring_clock();
+
+	/* a newer writer may have dropped its element meanwhile: the slot is
+	 * free now, its position stays skipped
+	 */
+	seq = RING_OW_BUSY(pos);
+	while (!__atomic_compare_exchange_n(&slot->seq, &seq,
+			seq == RING_OW_BUSY(pos) ? RING_OW_DONE(pos) : seq + 1,
+			0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Overwrite mode get. Readers that fell more than size behind jump to the
+ * oldest position still in the ring, entries overwritten under a reader (or
+ * dropped by their writer) are skipped one by one. Every skipped position is
+ * added to *missed.
+ */
+static int ring_buffer_get_ow(struct ring_buffer *r_buffer, void *elem,
+			      unsigned int *missed)
+{
+	unsigned long long tstamp = 0;
+	unsigned int pos, head, seq;
+	struct ring_slot *slot;
+	int stale;
+
+	pos = smp_load_acquire(&r_buffer->tail);
+	for (;;) {
+		head = smp_load_acquire(&r_buffer->head);
+		if (head - pos > r_buffer->size) {
+			if (__atomic_compare_exchange_n(&r_buffer->tail, &pos,
+					head - r_buffer->size, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				*missed += head - r_buffer->size - pos;
+				pos = head - r_buffer->size;
+			}
+			continue;
+		}
+		if (head == pos)
+			return -1;
+
+		slot = ring_slot(r_buffer, pos);
+		seq = smp_load_acquire(&slot->seq);
+		if ((int)(seq - RING_OW_BUSY(pos)) <= 0)
+			/* writer of pos did not finish (or start) yet */
+			return -1;
+
+		/* anything else than DONE(pos): dropped or overwritten */
+		stale = seq != RING_OW_DONE(pos);
+		if (!stale) {
+			memcpy(elem, (char *)slot + r_buffer->hdr, r_buffer->elem_size);
+			if (r_buffer->flags & RING_F_TSTAMP)
+				tstamp = *ring_slot_tstamp((char *)slot + r_buffer->hdr);
+			/* copy done before checking nobody wrote meanwhile */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (READ_ONCE(slot->seq) != seq)
+				continue;
+		}
+
+		/* on failure pos is updated with the current tail */
+		if (__atomic_compare_exchange_n(&r_buffer->tail, &pos, pos + 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			if (!stale) {
+				if (tstamp)
+					hist_add(ring_dwell(r_buffer),
+						 ring_clock() - tstamp);
+				return 0;
+			}
+			/* dropped or overwritten before we got to it */
+			(*missed)++;
+			pos++;
+		} else {
+			ring_stat_add(r_buffer, contended, 1);
+		}
+	}
+}
+
+/*
+ * Add an element in ring buffer.
+ *
+ * Please note that if the buffer is FULL, -1 is returned and the element
+ * is not added (RING_CLOSED if the ring is closed too). On success, 0 is
+ * returned. In overwrite mode the oldest element is dropped instead and
+ * put always succeeds.
+ */
+int ring_buffer_put(struct ring_buffer *r_buffer, void *elem)
+{
+	void *slot;
+
+	if (r_buffer->flags & RING_F_OVERWRITE) {
+		ring_buffer_put_ow(r_buffer, elem);
+		ring_stat_add(r_buffer, puts, 1);
+		ring_buffer_wake_readers(r_buffer, 1);
+		TRACE(TRACE_RING_PUT, r_buffer, 0);
+		return 0;
+	}
+
+	slot = ring_buffer_reserve(r_buffer);
+	if (!slot) {
+		TRACE(TRACE_RING_PUT, r_buffer, 1);
+		return READ_ONCE(r_buffer->closed) ? RING_CLOSED : -1;
+	}
+
+	memcpy(slot, elem, r_buffer->elem_size);
+	ring_buffer_commit(r_buffer, slot);
+
+	TRACE(TRACE_RING_PUT, r_buffer, 0);
 	return 0;
 }
 
 /*
  * Extract an element from ring buffer.
  *
- * If buffer is EMPTY, -1 is returned and there is no value inside elem.
+ * If buffer is EMPTY, -1 is returned and there is no value inside elem,
+ * RING_CLOSED if it is also closed (no element will ever come).
  * On success, 0 is returned.
  */
 int ring_buffer_get(struct ring_buffer *r_buffer, void *elem)
 {
+	int closed = 0;
+	void *slot;
 
-	if (r_buffer->head - r_buffer->tail == 0)
-		return -1;
+	if (r_buffer->flags & RING_F_OVERWRITE)
+		return ring_buffer_get_missed(r_buffer, elem, NULL);
+
+	slot = __ring_buffer_peek(r_buffer);
+	/* closed: look again, what was put before the close is visible now */
+	if (!slot && unlikely(closed = ring_buffer_closed(r_buffer)))
+		slot = __ring_buffer_peek(r_buffer);
+	if (!slot) {
+		/* one get, one EMPTY whatever the number of looks */
+		ring_stat_add(r_buffer, empty, 1);
+		ring_buffer_arm(r_buffer);
+		TRACE(TRACE_RING_GET, r_buffer, 1);
+		return closed ? RING_CLOSED : -1;
+	}
+
+	memcpy(elem, slot, r_buffer->elem_size);
+	ring_buffer_release(r_buffer, slot);
+
+	TRACE(TRACE_RING_GET, r_buffer, 0);
+	return 0;
+}
+
+/*
+ * Extract an element from ring buffer and tell how many entries before it
+ * were overwritten without being read (overwrite mode, always 0 in the
+ * other modes). *missed is set on EMPTY too, the lost entries are gone
+ * either way. missed may be NULL.
+ *
+ * If buffer is EMPTY, -1 is returned and there is no value inside elem,
+ * RING_CLOSED if it is also closed. On success, 0 is returned.
+ */
+int ring_buffer_get_missed(struct ring_buffer *r_buffer, void *elem,
+			   unsigned int *missed)
+{
+	unsigned int lost = 0;
+	int ret;
+
+	if (!(r_buffer->flags & RING_F_OVERWRITE)) {
+		ret = ring_buffer_get(r_buffer, elem);
+	} else {
+		ret = ring_buffer_get_ow(r_buffer, elem, &lost);
+		if (ret && unlikely(ring_buffer_closed(r_buffer)))
+			ret = ring_buffer_get_ow(r_buffer, elem, &lost) ?
+			      RING_CLOSED : 0;
+		TRACE(TRACE_RING_GET, r_buffer, !!ret);
+		if (lost)
+			ring_stat_add(r_buffer, lost, lost);
+		if (ret) {
+			ring_stat_add(r_buffer, empty, 1);
+			ring_buffer_arm(r_buffer);
+		} else
+			ring_stat_add(r_buffer, gets, 1);
+	}
+
+	if (missed)
+		*missed = lost;
+	return ret;
+}
+
+/*
+ * Copy n elements from elems into the slots starting at position pos. When
+ * the slots are packed (no header, no padding) this is at most two memcpy,
+ * one before and one after the end of the arena.
+ */
+static void ring_buffer_copy_in(struct ring_buffer *r_buffer, unsigned int pos,
+				const char *elems, unsigned int n)
+{
+	unsigned long long now;
+	unsigned int i, first;
+
+	if (r_buffer->flags & RING_F_TSTAMP) {
+		now = ring_clock();
+		for (i = 0; i < n; i++)
+			*ring_slot_tstamp(ring_slot_data(r_buffer, pos + i)) = now;
+	}
+
+	if (r_buffer->stride == r_buffer->elem_size) {
+		first = r_buffer->size - (pos & r_buffer->mask);
+		if (first > n)
+			first = n;
+		memcpy(ring_slot_data(r_buffer, pos), elems, first * r_buffer->elem_size);
+		memcpy(ring_slot_data(r_buffer, pos + first),
+		       elems + first * r_buffer->elem_size,
+		       (n - first) * r_buffer->elem_size);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		memcpy(ring_slot_data(r_buffer, pos + i),
+		       elems + i * r_buffer->elem_size, r_buffer->elem_size);
+}
+
+/*
+ * Copy n elements from the slots starting at position pos into elems.
+ */
+static void ring_buffer_copy_out(struct ring_buffer *r_buffer, unsigned int pos,
+				 char *elems, unsigned int n)
+{
+	unsigned long long now;
+	unsigned int i, first;
+
+	if (r_buffer->flags & RING_F_TSTAMP) {
+		struct hist *dwell = ring_dwell(r_buffer);
+
+		now = ring_clock();
+		for (i = 0; i < n; i++)
+			hist_add(dwell, now - *ring_slot_tstamp(
+				 ring_slot_data(r_buffer, pos + i)));
+	}
+
+	if (r_buffer->stride == r_buffer->elem_size) {
+		first = r_buffer->size - (pos & r_buffer->mask);
+		if (first > n)
+			first = n;
+		memcpy(elems, ring_slot_data(r_buffer, pos), first * r_buffer->elem_size);
+		memcpy(elems + first * r_buffer->elem_size,
+		       ring_slot_data(r_buffer, pos + first),
+		       (n - first) * r_buffer->elem_size);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		memcpy(elems + i * r_buffer->elem_size,
+		       ring_slot_data(r_buffer, pos + i), r_buffer->elem_size);
+}
+
+/*
+ * MPMC bulk claim. Count how many slots starting from pos are in the wanted
+ * state (seq == pos + i + off, off is 0 for writers and 1 for readers) and
+ * claim them all with a single CAS on idx. Slots seen in the wanted state
+ * can't change before the CAS succeeds, only the owner of a position touches
+ * its slot. Return the number of claimed slots, first one in *start.
+ */
+static unsigned int ring_buffer_claim_mpmc(struct ring_buffer *r_buffer,
+					   volatile unsigned int *idx,
+					   unsigned int off, unsigned int n,
+					   int all, unsigned int *start)
+{
+	unsigned int pos, seq, cnt;
+	int diff;
+
+	pos = READ_ONCE(*idx);
+	for (;;) {
+		for (cnt = 0; cnt < n; cnt++) {
+			seq = smp_load_acquire(&ring_slot(r_buffer, pos + cnt)->seq);
+			diff = (int)(seq - (pos + cnt + off));
+			if (diff)
+				break;
+		}
+
+		if (!cnt && diff > 0) {
+			/* another thread took pos */
+			pos = READ_ONCE(*idx);
+			continue;
+		}
+		if (!cnt || (all && cnt < n))
+			return 0;
+
+		/* on failure pos is updated with the current index */
+		if (__atomic_compare_exchange_n(idx, &pos, pos + cnt, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		ring_stat_add(r_buffer, contended, 1);
+	}
+
+	*start = pos;
+	return cnt;
+}
+
+/*
+ * Add up to n elements (stored one after the other in elems) in the ring
+ * under a single lock/claim. With all set either n elements or none are
+ * added. Return the number of elements added.
+ */
+static unsigned int ring_buffer_put_n(struct ring_buffer *r_buffer,
+				      void *elems, unsigned int n, int all)
+{
+	unsigned int i, pos, cnt;
+
+	if (!n)
+		return 0;
+
+	if (r_buffer->flags & RING_F_OVERWRITE) {
+		for (i = 0; i < n; i++)
+			ring_buffer_put_ow(r_buffer, (char *)elems +
+					   i * r_buffer->elem_size);
+		return n;
+	}
+
+	if (r_buffer->flags & RING_F_MPMC) {
+		cnt = ring_buffer_claim_mpmc(r_buffer, &r_buffer->head, 0, n,
+					     all, &pos);
+		if (cnt && ring_lap_start(r_buffer, pos, cnt))
+			ring_stat_hwm(r_buffer,
+				      pos + cnt - READ_ONCE(r_buffer->tail));
+		ring_buffer_copy_in(r_buffer, pos, elems, cnt);
+		for (i = 0; i < cnt; i++)
+			smp_store_release(&ring_slot(r_buffer, pos + i)->seq,
+					  pos + i + 1);
+		return cnt;
+	}
+
+	if (r_buffer->flags & RING_F_SPSC) {
+		pos = r_buffer->head;
+		cnt = r_buffer->size - (pos - r_buffer->tail_cache);
+		if (cnt < n) {
+			r_buffer->tail_cache = smp_load_acquire(&r_buffer->tail);
+			cnt = r_buffer->size - (pos - r_buffer->tail_cache);
+			ring_stat_hwm(r_buffer, pos - r_buffer->tail_cache);
+		}
+		if (cnt > n)
+			cnt = n;
+		if (!cnt || (all && cnt < n))
+			return 0;
+
+		ring_buffer_copy_in(r_buffer, pos, elems, cnt);
+		smp_store_release(&r_buffer->head, pos + cnt);
+		return cnt;
+	}
+
+	if (r_buffer->head - r_buffer->tail == r_buffer->size)
+		return 0;
 
 #ifdef MULTI_THREADING
-	pthread_mutex_lock(&r_buffer->r_mutex);
-	/* double check locking */
-	if (r_buffer->head - r_buffer->tail == 0) {
-		pthread_mutex_unlock(&r_buffer->r_mutex);
-		return -1;
+	ring_buffer_lock(r_buffer);
+#endif
+	cnt = r_buffer->size - (r_buffer->head - r_buffer->tail);
+	if (cnt > n)
+		cnt = n;
+	if (all && cnt < n) {
+		cnt = 0;
+	} else {
+		ring_buffer_copy_in(r_buffer, r_buffer->head, elems, cnt);
+		r_buffer->head += cnt;
+		ring_stat_hwm(r_buffer, r_buffer->head - r_buffer->tail);
 	}
+#ifdef MULTI_THREADING
+	pthread_mutex_unlock(&r_buffer->r_mutex);
 #endif
 
-	memcpy(elem, r_buffer->buffer[r_buffer->tail % r_buffer->size], r_buffer->elem_size);
-	++r_buffer->tail;
+	return cnt;
+}
+
+/*
+ * Extract up to n elements from the ring into elems under a single
+ * lock/claim. With all set either n elements or none are extracted. Return
+ * the number of elements extracted.
+ */
+static unsigned int ring_buffer_get_n(struct ring_buffer *r_buffer,
+				      void *elems, unsigned int n, int all)
+{
+	unsigned int i, pos, cnt, lost = 0;
+
+	if (!n)
+		return 0;
+
+	/* entries may be overwritten while copying, bulk only checks the
+	 * count before starting
+	 */
+	if (r_buffer->flags & RING_F_OVERWRITE) {
+		if (all && ring_buffer_count(r_buffer) < n)
+			return 0;
+		for (cnt = 0; cnt < n; cnt++)
+			if (ring_buffer_get_ow(r_buffer, (char *)elems +
+					       cnt * r_buffer->elem_size, &lost))
+				break;
+		if (lost)
+			ring_stat_add(r_buffer, lost, lost);
+		return cnt;
+	}
+
+	if (r_buffer->flags & RING_F_MPMC) {
+		cnt = ring_buffer_claim_mpmc(r_buffer, &r_buffer->tail, 1, n,
+					     all, &pos);
+		ring_buffer_copy_out(r_buffer, pos, elems, cnt);
+		for (i = 0; i < cnt; i++)
+			smp_store_release(&ring_slot(r_buffer, pos + i)->seq,
+					  pos + i + r_buffer->size);
+		return cnt;
+	}
+
+	if (r_buffer->flags & RING_F_SPSC) {
+		pos = r_buffer->tail;
+		cnt = r_buffer->head_cache - pos;
+		if (cnt < n) {
+			r_buffer->head_cache = smp_load_acquire(&r_buffer->head);
+			cnt = r_buffer->head_cache - pos;
+		}
+		if (cnt > n)
+			cnt = n;
+		if (!cnt || (all && cnt < n))
+			return 0;
+
+		ring_buffer_copy_out(r_buffer, pos, elems, cnt);
+		smp_store_release(&r_buffer->tail, pos + cnt);
+		return cnt;
+	}
+
+	if (r_buffer->head - r_buffer->tail == 0)
+		return 0;
 
+#ifdef MULTI_THREADING
+	ring_buffer_lock(r_buffer);
+#endif
+	cnt = r_buffer->head - r_buffer->tail;
+	if (cnt > n)
+		cnt = n;
+	if (all && cnt < n) {
+		cnt = 0;
+	} else {
+		ring_buffer_copy_out(r_buffer, r_buffer->tail, elems, cnt);
+		r_buffer->tail += cnt;
+	}
 #ifdef MULTI_THREADING
 	pthread_mutex_unlock(&r_buffer->r_mutex);
 #endif
+
+	return cnt;
+}
+
+/*
+ * Add n elements in ring buffer, all or nothing. Return n on success, 0 if
+ * there is not enough room for all of them.
+ */
+unsigned int ring_buffer_put_bulk(struct ring_buffer *r_buffer, void *elems,
+				  unsigned int n)
+{
+	unsigned int cnt;
+
+	cnt = ring_buffer_put_n(r_buffer, elems, n, 1);
+	if (cnt) {
+		ring_stat_add(r_buffer, puts, cnt);
+		ring_buffer_wake_readers(r_buffer, cnt);
+	} else if (n) {
+		ring_stat_add(r_buffer, full, 1);
+	}
+
+	return cnt;
+}
+
+/*
+ * Add as many of the n elements as fit in ring buffer. Return the number of
+ * elements added (0 if the buffer is FULL).
+ */
+unsigned int ring_buffer_put_burst(struct ring_buffer *r_buffer, void *elems,
+				   unsigned int n)
+{
+	unsigned int cnt;
+
+	cnt = ring_buffer_put_n(r_buffer, elems, n, 0);
+	if (cnt) {
+		ring_stat_add(r_buffer, puts, cnt);
+		ring_buffer_wake_readers(r_buffer, cnt);
+	} else if (n) {
+		ring_stat_add(r_buffer, full, 1);
+	}
+
+	return cnt;
+}
+
+/*
+ * Extract n elements from ring buffer, all or nothing. Return n on success,
+ * 0 if there are less than n elements.
+ *
+ * In overwrite mode the entries skipped on the way are only counted in the
+ * lost statistic, use ring_buffer_get_missed to learn about them.
+ */
+unsigned int ring_buffer_get_bulk(struct ring_buffer *r_buffer, void *elems,
+				  unsigned int n)
+{
+	unsigned int cnt;
+
+	cnt = ring_buffer_get_n(r_buffer, elems, n, 1);
+	if (cnt) {
+		ring_stat_add(r_buffer, gets, cnt);
+		ring_buffer_wake_writers(r_buffer, cnt);
+	} else if (n) {
+		ring_stat_add(r_buffer, empty, 1);
+		ring_buffer_arm(r_buffer);
+	}
+
+	return cnt;
+}
+
+/*
+ * Extract up to n elements from ring buffer. Return the number of elements
+ * extracted (0 if the buffer is EMPTY).
+ *
+ * Overwrite mode misses are reported as for ring_buffer_get_bulk.
+ */
+unsigned int ring_buffer_get_burst(struct ring_buffer *r_buffer, void *elems,
+				   unsigned int n)
+{
+	unsigned int cnt;
+
+	cnt = ring_buffer_get_n(r_buffer, elems, n, 0);
+	if (cnt) {
+		ring_stat_add(r_buffer, gets, cnt);
+		ring_buffer_wake_writers(r_buffer, cnt);
+	} else if (n) {
+		ring_stat_add(r_buffer, empty, 1);
+		ring_buffer_arm(r_buffer);
+	}
+
+	return cnt;
+}
+
+/*
+ * Sum the counters of all the shards in stats. Return 0 on success, -1 with
+ * errno EINVAL if the ring was not created with RING_F_STATS or the library
+ * was built without RING_STATS.
+ */
+int ring_buffer_stats(struct ring_buffer *r_buffer, struct ring_buffer_stats *stats)
+{
+#ifdef RING_STATS
+	struct ring_stats_shard *shard;
+	unsigned int i;
+
+	if (r_buffer->stats) {
+		memset(stats, 0, sizeof(*stats));
+		for (i = 0; i < RING_SHARDS; i++) {
+			shard = &r_buffer->stats[i];
+			stats->puts += READ_ONCE(shard->puts);
+			stats->gets += READ_ONCE(shard->gets);
+			stats->full += READ_ONCE(shard->full);
+			stats->empty += READ_ONCE(shard->empty);
+			stats->contended += READ_ONCE(shard->contended);
+			stats->lost += READ_ONCE(shard->lost);
+			if (READ_ONCE(shard->hwm) > stats->hwm)
+				stats->hwm = READ_ONCE(shard->hwm);
+		}
+		stats->bytes_in = stats->puts * r_buffer->elem_size;
+		stats->bytes_out = stats->gets * r_buffer->elem_size;
+		return 0;
+	}
+#endif
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Copy the dwell time histogram (time between commit and release of the
+ * elements, ring_clock units) in dwell. Return 0 on success, -1 with errno
+ * EINVAL if the ring was not created with RING_F_TSTAMP. The shards are
+ * merged one after the other, readers may keep adding meanwhile.
+ */
+int ring_buffer_dwell(struct ring_buffer *r_buffer, struct hist *dwell)
+{
+	unsigned int i;
+
+	if (!r_buffer->dwell) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hist_init(dwell);
+	for (i = 0; i < RING_SHARDS; i++)
+		hist_merge(dwell, &r_buffer->dwell[i].hist);
 	return 0;
 }
 
+/*
+ * Return the eventfd of a ring created with RING_F_EVENTFD, -1 with errno
+ * EINVAL otherwise. It becomes readable (POLLIN/EPOLLIN) when elements
+ * arrive in the EMPTY ring. The reader must get until EMPTY before waiting
+ * on it again, finding the ring EMPTY is what re-arms it. Don't read it.
+ */
+int ring_buffer_fd(struct ring_buffer *r_buffer)
+{
+	if (!(r_buffer->flags & RING_F_EVENTFD)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return r_buffer->efd;
+}
+
+/*
+ * Mark in ready[] the rings that are not EMPTY or closed, return how many.
+ */
+static int ring_buffer_ready(struct ring_buffer **rings, unsigned int nr,
+			     unsigned char *ready)
+{
+	unsigned int i;
+	int cnt = 0;
+
+	for (i = 0; i < nr; i++) {
+		ready[i] = ring_buffer_count(rings[i]) ||
+			   READ_ONCE(rings[i]->closed);
+		cnt += ready[i];
+	}
+
+	return cnt;
+}
+
+/*
+ * CLOCK_MONOTONIC in ms, for the poll timeouts.
+ */
+static long long ring_buffer_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait until at least one of the nr rings (created with RING_F_EVENTFD)
+ * is not EMPTY, at most timeout_ms milliseconds (-1 waits forever).
+ * ready[i] is set for every ring with elements or closed.
+ *
+ * Return the number of ready rings, 0 on timeout, -1 with errno set on
+ * error (EINVAL: more than RING_SELECT_MAX rings or a ring without
+ * RING_F_EVENTFD).
+ */
+int ring_buffer_select(struct ring_buffer **rings, unsigned int nr,
+		       unsigned char *ready, int timeout_ms)
+{
+	struct pollfd fds[RING_SELECT_MAX];
+	long long deadline = 0;
+	int cnt, left = timeout_ms;
+	unsigned int i;
+
+	if (nr > RING_SELECT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* elements already there, no system call */
+	cnt = ring_buffer_ready(rings, nr, ready);
+	if (cnt)
+		return cnt;
+
+	for (i = 0; i < nr; i++) {
+		fds[i].fd = ring_buffer_fd(rings[i]);
+		if (fds[i].fd < 0)
+			return -1;
+		fds[i].events = POLLIN;
+		ring_buffer_arm(rings[i]);
+	}
+
+	/* a wakeup for nothing must not restart the full timeout */
+	if (timeout_ms > 0)
+		deadline = ring_buffer_ms() + timeout_ms;
+
+	for (;;) {
+		cnt = ring_buffer_ready(rings, nr, ready);
+		if (cnt || !left)
+			return cnt;
+
+		cnt = poll(fds, nr, left);
+		if (cnt <= 0)
+			return cnt;
+		/* signaled, but another reader may have emptied the ring */
+		for (i = 0; i < nr; i++)
+			if (fds[i].revents & POLLIN)
+				ring_buffer_arm(rings[i]);
+
+		if (timeout_ms > 0) {
+			left = deadline - ring_buffer_ms();
+			if (left < 0)
+				left = 0;
+		}
+	}
+}
+
+/*
+ * Spin a little, then sleep on event until try() succeeds, returns
+ * RING_CLOSED or the deadline passes. The spin budget follows the number of
+ * iterations that were needed last times: it grows when spinning pays off
+ * and decays when the thread ends up sleeping anyway.
+ */
+static int ring_buffer_wait(struct ring_buffer *r_buffer, void *elem,
+			    int (*try)(struct ring_buffer *, void *),
+			    unsigned int *waiting, unsigned int *event,
+			    const struct timespec *timeout)
+{
+	struct timespec deadline;
+	unsigned int i, ev, spin;
+	int ret;
+
+	if (!(r_buffer->flags & RING_F_WAIT)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	spin = READ_ONCE(r_buffer->spin);
+	for (i = 0; i < spin; i++) {
+		cpu_relax();
+		ret = try(r_buffer, elem);
+		if (ret == RING_CLOSED)
+			return ret;
+		if (!ret) {
+			spin += ((int)(2 * i) - (int)spin) / 8;
+			if (spin < RING_SPIN_MIN)
+				spin = RING_SPIN_MIN;
+			if (spin > RING_SPIN_MAX)
+				spin = RING_SPIN_MAX;
+			WRITE_ONCE(r_buffer->spin, spin);
+			return 0;
+		}
+	}
+	spin -= spin / 8;
+	WRITE_ONCE(r_buffer->spin, spin < RING_SPIN_MIN ? RING_SPIN_MIN : spin);
+
+	if (timeout)
+		futex_deadline(timeout, &deadline);
+
+	for (;;) {
+		__atomic_fetch_add(waiting, 1, __ATOMIC_SEQ_CST);
+		ev = smp_load_acquire(event);
+		ret = try(r_buffer, elem);
+		if (ret != -1) {
+			__atomic_fetch_sub(waiting, 1, __ATOMIC_RELAXED);
+			return ret;
+		}
+
+		ret = futex_wait(event, ev, timeout ? &deadline : NULL);
+		__atomic_fetch_sub(waiting, 1, __ATOMIC_RELAXED);
+		if (ret && errno == ETIMEDOUT) {
+			ret = try(r_buffer, elem);
+			if (ret != -1)
+				return ret;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+/*
+ * Add an element in ring buffer, waiting for room if the buffer is FULL.
+ * The ring must be created with RING_F_WAIT.
+ *
+ * Return 0 on success, -1 with errno ETIMEDOUT if the element could not be
+ * added within timeout (NULL waits forever), RING_CLOSED if the ring is
+ * FULL and closed.
+ */
+int ring_buffer_put_wait(struct ring_buffer *r_buffer, void *elem,
+			 const struct timespec *timeout)
+{
+	int ret;
+
+	ret = ring_buffer_put(r_buffer, elem);
+	if (ret != -1)
+		return ret;
+
+	return ring_buffer_wait(r_buffer, elem, ring_buffer_put,
+				&r_buffer->writers_waiting,
+				&r_buffer->get_event, timeout);
+}
+
+/*
+ * Extract an element from ring buffer, waiting for one if the buffer is
+ * EMPTY. The ring must be created with RING_F_WAIT.
+ *
+ * Return 0 on success, -1 with errno ETIMEDOUT if nothing arrived within
+ * timeout (NULL waits forever), RING_CLOSED once the ring is closed and
+ * EMPTY.
+ */
+int ring_buffer_get_wait(struct ring_buffer *r_buffer, void *elem,
+			 const struct timespec *timeout)
+{
+	int ret;
+
+	ret = ring_buffer_get(r_buffer, elem);
+	if (ret != -1)
+		return ret;
+
+	return ring_buffer_wait(r_buffer, elem, ring_buffer_get,
+				&r_buffer->readers_waiting,
+				&r_buffer->put_event, timeout);
+}
+
 /*
  * Reset the ring buffer.
  */
 void ring_buffer_reset(struct ring_buffer *r_buffer)
 {
+	unsigned int i;
+
 	r_buffer->head = r_buffer->tail = 0;
+	r_buffer->head_cache = r_buffer->tail_cache = 0;
+	r_buffer->closed = 0;
+	if (r_buffer->flags & RING_F_MPMC)
+		for (i = 0; i < r_buffer->size; i++)
+			ring_slot(r_buffer, i)->seq = i;
+	if (r_buffer->flags & RING_F_OVERWRITE)
+		for (i = 0; i < r_buffer->size; i++)
+			ring_slot(r_buffer, i)->seq = RING_OW_DONE(i - r_buffer->size);
 }
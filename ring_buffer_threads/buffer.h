@@ -1,6 +1,8 @@
 /* Ring buffer design
  * Copyright (C) 2020 Lazar Razvan
  */
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
 
 #include "stddef.h"
 #include "string.h"
@@ -8,32 +10,271 @@
 #include "stdlib.h"
 #include "stdio.h"
 #include "pthread.h"
+#include "time.h"
+#include "compiler.h"
+#include "hist.h"
+#include "trace_point.h"
 
 /* Change after first put */
 #define BUFFER_READY	1
 #define BUFFER_WAIT	2
 
+/* Ring flags, selected at ring_buffer_init_flags time */
+#define RING_F_SPSC	0x1	/* one writer/one reader, lock free */
+#define RING_F_MPMC	0x2	/* many writers/readers, lock free (CAS) */
+#define RING_F_CACHE_ALIGN 0x4	/* pad each slot to a multiple of CACHE_LINE */
+#define RING_F_WAIT	0x8	/* ring used with ring_buffer_*_wait */
+#define RING_F_STATS	0x10	/* keep counters (needs RING_STATS) */
+#define RING_F_OVERWRITE 0x20	/* lossy: put on FULL drops the oldest */
+#define RING_F_MIRROR	0x40	/* data mapped twice, see mirror.h (var_ring) */
+#define RING_F_EVENTFD	0x80	/* eventfd readable when data arrives */
+#define RING_F_TSTAMP	0x100	/* time spent in the ring, see ring_buffer_dwell */
+
+/* Per thread data shards (statistics, ...), see ring_thread_shard */
+#define RING_SHARDS	16
+
+/* Adaptive spinning before sleeping in ring_buffer_*_wait */
+#define RING_SPIN_MIN	16
+#define RING_SPIN_MAX	4096
+
+/* Max rings in a ring_buffer_select */
+#define RING_SELECT_MAX	64
+
+/* Returned by get on a closed ring once it is EMPTY, see ring_buffer_close */
+#define RING_CLOSED	-2
+
+/* Alignment of the elements inside the slot arena */
+#define RING_SLOT_ALIGN	8
+
+/* Mode used by ring_buffer_init. Build with -DRING_DEFAULT_FLAGS=RING_F_MPMC
+ * to switch existing callers to another mode without touching them.
+ */
+#ifndef RING_DEFAULT_FLAGS
+#define RING_DEFAULT_FLAGS	0
+#endif
+
+/* x evaluated once: tracing the first error of a thread may change errno */
 #define ON_ERR(x) \
 do { \
-	fprintf(stderr, "%s [%d: %s\n", __func__, (x), strerror(x)); \
+	int __err = (x); \
+	TRACE(TRACE_ERROR, __err, __LINE__); \
+	fprintf(stderr, "%s [%d: %s\n", __func__, __err, strerror(__err)); \
 } while(0) \
 
 extern int errno;
 
-/* Structure use for a ring buffer */
+/*
+ * Structure use for a ring buffer
+ *
+ * Producer (head) and consumer (tail) indexes live on different cache lines
+ * so a writer and a reader running on different cores don't keep stealing
+ * the same line from each other. In SPSC mode each side also keeps a cached
+ * copy of the other side index and only reloads it when the ring looks
+ * full/empty.
+ *
+ * All the slots are in one allocation that follows the structure, slot i
+ * starts at slots + i * stride. Slots of modes that need per slot state
+ * start with a struct ring_slot header, the element follows it at hdr.
+ *
+ * In MPMC mode every slot has a sequence number telling whose turn
+ * it is: seq == pos means the slot is free for the writer of position pos,
+ * seq == pos + 1 means it holds the element for the reader of position pos.
+ * Writers/readers claim a position with a CAS on head/tail and never wait
+ * for each other on a lock.
+ *
+ * In overwrite mode (RING_F_OVERWRITE) puts never fail: a writer takes the
+ * next position with a fetch_add on head and writes the slot even if the
+ * reader did not get it yet. The slot seq is a seqlock keyed by position,
+ * 2 * pos + 1 while the writer of pos copies the element, 2 * pos + 2 once
+ * it is done, so a reader can tell a stable element from one that is being
+ * or was overwritten. Readers move tail with a CAS, past the entries that
+ * were overwritten before they got to them, and report how many.
+ *
+ * With RING_F_WAIT, threads that find the ring full/empty can sleep on a
+ * futex (ring_buffer_*_wait). Writers only bump put_event and wake readers
+ * when readers_waiting says somebody sleeps, and the other way around.
+ *
+ * With RING_F_TSTAMP the slot header ends with the time the element was
+ * committed (ring_clock), readers add the time it stayed in the ring to
+ * their shard of the dwell histogram when they release it.
+ *
+ * With RING_F_EVENTFD the ring owns an eventfd that becomes readable on
+ * the empty -> non empty transition, so consumers can wait on it with
+ * poll/epoll next to other file descriptors. A reader that finds the ring
+ * empty clears the eventfd and arms it, the first writer that finds it
+ * armed disarms it and writes the eventfd: one system call per transition,
+ * not per element.
+ *
+ * ring_buffer_close marks the end of the stream: readers that find the
+ * ring EMPTY afterwards get RING_CLOSED instead of -1 and all the sleepers
+ * are woken up, so consumers stop without counting the messages.
+ */
 struct ring_buffer {
-	void			**buffer;	/* buffer */
-	volatile unsigned int	head;		/* pointer to head of buffer */
-	volatile unsigned int	tail;		/* pointer to end of buffer */
 	size_t			elem_size;	/* sizeof elements in buffer */
 	size_t			size;		/* size of buffer */
-#ifdef MULTI_THREADING
-	pthread_mutex_t		r_mutex;	/* synchronize threads */
-#endif
+	size_t			stride;		/* distance between slots */
+	size_t			hdr;		/* offset of element in slot */
+	unsigned int		mask;		/* size - 1 */
+	unsigned int		flags;		/* RING_F_* */
+	unsigned int		closed;		/* ring_buffer_close was called */
+	/* always there: objects built without MULTI_THREADING see the same
+	 * layout (ring_buffer_count and the other inlines read head/tail)
+	 */
+	pthread_mutex_t		r_mutex;	/* synchronize threads (MULTI_THREADING) */
+	/* producer side */
+	volatile unsigned int	head __cacheline_aligned; /* pointer to head of buffer */
+	unsigned int		tail_cache;	/* producer copy of tail */
+	/* consumer side */
+	volatile unsigned int	tail __cacheline_aligned; /* pointer to end of buffer */
+	unsigned int		head_cache;	/* consumer copy of head */
+	/* sleepers (RING_F_WAIT), only touched on the slow path */
+	unsigned int		put_event __cacheline_aligned; /* futex, readers sleep on it */
+	unsigned int		get_event;	/* futex, writers sleep on it */
+	unsigned int		readers_waiting;
+	unsigned int		writers_waiting;
+	unsigned int		spin;		/* adaptive spin before sleep */
+	/* readiness notification (RING_F_EVENTFD) */
+	int			efd;		/* eventfd, -1 if not used */
+	unsigned int		armed;		/* next put signals the eventfd */
+	/* counters (RING_F_STATS), after the slots in the same allocation */
+	struct ring_stats_shard	*stats;
+	/* dwell times (RING_F_TSTAMP), after the counters */
+	struct ring_dwell_shard	*dwell;
+	/* slot arena */
+	char			slots[] __cacheline_aligned;
 };
 
+/*
+ * Counters updated by the threads mapped on this shard. Each shard has its
+ * own cache line so threads on different shards never share a line.
+ */
+struct ring_stats_shard {
+	unsigned long		puts;		/* elements added */
+	unsigned long		gets;		/* elements extracted */
+	unsigned long		full;		/* put rejected, buffer FULL */
+	unsigned long		empty;		/* get rejected, buffer EMPTY */
+	unsigned long		contended;	/* lock busy / CAS retry */
+	unsigned long		lost;		/* overwritten before read */
+	unsigned int		hwm;		/* highest occupancy seen */
+} __cacheline_aligned;
+
+/* Per thread dwell time histogram (RING_F_TSTAMP), merged on read */
+struct ring_dwell_shard {
+	struct hist		hist;
+} __cacheline_aligned;
+
+/* Snapshot returned by ring_buffer_stats */
+struct ring_buffer_stats {
+	unsigned long		puts;
+	unsigned long		gets;
+	unsigned long		full;
+	unsigned long		empty;
+	unsigned long		contended;
+	unsigned long		lost;
+	unsigned int		hwm;
+	unsigned long		bytes_in;	/* puts * elem_size */
+	unsigned long		bytes_out;	/* gets * elem_size */
+};
 
-struct ring_buffer * ring_buffer_init(size_t elem_size, size_t order);
+/* Per slot header */
+struct ring_slot {
+	unsigned int		seq;		/* whose turn it is (MPMC, OVERWRITE) */
+};
+
+static inline struct ring_slot *ring_slot(struct ring_buffer *r_buffer,
+					  unsigned int pos)
+{
+	return (struct ring_slot *)(r_buffer->slots +
+				    (pos & r_buffer->mask) * r_buffer->stride);
+}
+
+static inline void *ring_slot_data(struct ring_buffer *r_buffer,
+				   unsigned int pos)
+{
+	return (char *)ring_slot(r_buffer, pos) + r_buffer->hdr;
+}
+
+/* Commit time of an element (RING_F_TSTAMP), right before it in the slot */
+static inline unsigned long long *ring_slot_tstamp(void *elem)
+{
+	return (unsigned long long *)elem - 1;
+}
+
+/*
+ * Clock of the timestamps: ns of CLOCK_MONOTONIC_RAW (vDSO, not slewed by
+ * NTP), or TSC cycles when built with -DRING_TSC (x86, constant TSC).
+ */
+static inline unsigned long long ring_clock(void)
+{
+#if defined(RING_TSC) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Number of elements in the ring, without taking any lock. Only a snapshot
+ * when other threads use the ring. In MPMC mode head/tail count claimed
+ * positions, so the value is capped to the ring size.
+ */
+static inline unsigned int ring_buffer_count(struct ring_buffer *r_buffer)
+{
+	unsigned int used;
+
+	used = READ_ONCE(r_buffer->head) - READ_ONCE(r_buffer->tail);
+	return used > r_buffer->size ? r_buffer->size : used;
+}
+
+/*
+ * Tell if ring_buffer_close was called. A reader of the bulk/burst API that
+ * gets 0 elements and then sees the ring closed must try once more: the
+ * elements put before the close are visible after this returns 1.
+ */
+static inline int ring_buffer_closed(struct ring_buffer *r_buffer)
+{
+	return smp_load_acquire(&r_buffer->closed);
+}
+
+
+struct ring_buffer * ring_buffer_init(size_t elem_size, size_t size);
+struct ring_buffer * ring_buffer_init_flags(size_t elem_size, size_t size,
+					    unsigned int flags);
 void ring_buffer_free(struct ring_buffer *r_buffer);
+void ring_buffer_close(struct ring_buffer *r_buffer);
 int ring_buffer_put(struct ring_buffer *r_buffer, void *elem);
 int ring_buffer_get(struct ring_buffer *r_buffer, void *elem);
+int ring_buffer_get_missed(struct ring_buffer *r_buffer, void *elem,
+			   unsigned int *missed);
+/* Bulk: all or nothing (bulk) and as many as possible (burst) */
+unsigned int ring_buffer_put_bulk(struct ring_buffer *r_buffer, void *elems,
+				  unsigned int n);
+unsigned int ring_buffer_put_burst(struct ring_buffer *r_buffer, void *elems,
+				   unsigned int n);
+unsigned int ring_buffer_get_bulk(struct ring_buffer *r_buffer, void *elems,
+				  unsigned int n);
+unsigned int ring_buffer_get_burst(struct ring_buffer *r_buffer, void *elems,
+				   unsigned int n);
+/* Blocking (RING_F_WAIT), timeout is relative, NULL waits forever */
+int ring_buffer_put_wait(struct ring_buffer *r_buffer, void *elem,
+			 const struct timespec *timeout);
+int ring_buffer_get_wait(struct ring_buffer *r_buffer, void *elem,
+			 const struct timespec *timeout);
+/* Readiness notification (RING_F_EVENTFD) */
+int ring_buffer_fd(struct ring_buffer *r_buffer);
+int ring_buffer_select(struct ring_buffer **rings, unsigned int nr,
+		       unsigned char *ready, int timeout_ms);
+unsigned int ring_thread_shard(void);
+/* Statistics (RING_F_STATS), dwell time histogram (RING_F_TSTAMP) */
+int ring_buffer_stats(struct ring_buffer *r_buffer, struct ring_buffer_stats *stats);
+int ring_buffer_dwell(struct ring_buffer *r_buffer, struct hist *dwell);
+/* Zero copy */
+void *ring_buffer_reserve(struct ring_buffer *r_buffer);
+void ring_buffer_commit(struct ring_buffer *r_buffer, void *elem);
+void *ring_buffer_peek(struct ring_buffer *r_buffer);
+void ring_buffer_release(struct ring_buffer *r_buffer, void *elem);
+
+#endif /* __RING_BUFFER_H__ */
@@ -0,0 +1,41 @@
+/* Ring buffer design
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Compiler and memory ordering helpers shared by the ring variants. The
+ * names follow the Linux kernel ones, the implementation uses the GCC
+ * __atomic builtins so they work on plain (non _Atomic) fields.
+ */
+#ifndef __RING_COMPILER_H__
+#define __RING_COMPILER_H__
+
+#define CACHE_LINE		64
+#define __cacheline_aligned	__attribute__((aligned(CACHE_LINE)))
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+/* Round x up to a multiple of a (power of 2) */
+#define ALIGN(x, a)		(((x) + ((a) - 1)) & ~((a) - 1))
+#define is_power_of_2(x)	((x) != 0 && (((x) & ((x) - 1)) == 0))
+
+/* Plain accesses the compiler is not allowed to tear, merge or cache */
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* Publish/consume pairs: everything before the release is visible after
+ * the matching acquire.
+ */
+#define smp_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Busy wait hint for the CPU (spinning on a shared location) */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax()		__asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()		__asm__ __volatile__("" ::: "memory")
+#endif
+
+#endif /* __RING_COMPILER_H__ */
@@ -0,0 +1,421 @@
+/* Durable (file backed) ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "durable_ring.h"
+
+#define REC_HDR		sizeof(struct durable_rec)
+
+/* header of a file created but not initialized yet */
+static const struct durable_hdr durable_hdr_zero;
+
+static unsigned int crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	unsigned int i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+static unsigned int crc32(unsigned int crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static unsigned int durable_rec_crc(struct durable_ring *d_ring,
+				    struct durable_rec *rec)
+{
+	unsigned int crc;
+
+	crc = crc32(0, &rec->seq, sizeof(rec->seq));
+	return crc32(crc, rec + 1, d_ring->elem_size);
+}
+
+static inline struct durable_rec *durable_rec_at(struct durable_ring *d_ring,
+						 unsigned long long pos)
+{
+	return (struct durable_rec *)(d_ring->slots +
+				      (pos & (d_ring->size - 1)) * d_ring->stride);
+}
+
+static inline void durable_ring_lock(struct durable_ring *d_ring,
+				     pthread_mutex_t *mutex)
+{
+#ifdef MULTI_THREADING
+	if (!(d_ring->flags & RING_F_SPSC))
+		pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline void durable_ring_unlock(struct durable_ring *d_ring,
+				       pthread_mutex_t *mutex)
+{
+#ifdef MULTI_THREADING
+	if (!(d_ring->flags & RING_F_SPSC))
+		pthread_mutex_unlock(mutex);
+#endif
+}
+
+#ifdef MULTI_THREADING
+#define W_MUTEX(d)	(&(d)->w_mutex)
+#define R_MUTEX(d)	(&(d)->r_mutex)
+#else
+#define W_MUTEX(d)	NULL
+#define R_MUTEX(d)	NULL
+#endif
+
+/*
+ * Write back [off, off + len) of the mapping. msync wants a page aligned
+ * start.
+ */
+static int durable_ring_flush(struct durable_ring *d_ring, size_t off,
+			      size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE), start;
+
+	if (d_ring->flags & DURABLE_F_FDATASYNC)
+		return fdatasync(d_ring->fd);
+
+	start = off & ~(page - 1);
+	return msync((char *)d_ring->hdr + start, off + len - start, MS_SYNC);
+}
+
+/*
+ * Write back the records added since the last sync. w_mutex held.
+ */
+static int durable_ring_sync_records(struct durable_ring *d_ring)
+{
+	unsigned long long from = d_ring->synced, to = d_ring->hdr->head;
+	size_t first, n = to - from;
+	int err = 0;
+
+	if (!n)
+		return 0;
+
+	/* at most two ranges, before and after the end of the slots */
+	first = d_ring->size - (from & (d_ring->size - 1));
+	if (first > n)
+		first = n;
+	err |= durable_ring_flush(d_ring, (char *)durable_rec_at(d_ring, from) -
+				  (char *)d_ring->hdr, first * d_ring->stride);
+	if (n > first && !(d_ring->flags & DURABLE_F_FDATASYNC))
+		err |= durable_ring_flush(d_ring, DURABLE_HDR_SIZE,
+					  (n - first) * d_ring->stride);
+
+	if (!err) {
+		d_ring->synced = to;
+		d_ring->puts = 0;
+	}
+	return err ? -1 : 0;
+}
+
+/*
+ * Write back the header (tail). r_mutex held.
+ */
+static int durable_ring_sync_hdr(struct durable_ring *d_ring)
+{
+	if (durable_ring_flush(d_ring, 0, sizeof(struct durable_hdr)))
+		return -1;
+
+	d_ring->gets = 0;
+	return 0;
+}
+
+static inline int durable_rec_valid(struct durable_ring *d_ring,
+				    struct durable_rec *rec, unsigned long long pos)
+{
+	return rec->seq == pos + 1 && rec->crc == durable_rec_crc(d_ring, rec);
+}
+
+/*
+ * Rebuild head and tail from the records. Every record is tagged with its
+ * position, the newest valid one tells which lap the ring is on. Elements
+ * start at the saved tail, unless writers reused the slot before the tail
+ * reached the disk (power loss), then at the oldest position of that lap.
+ * From there every record tagged with its own position and with a good
+ * checksum is an element; the first one that is not (never written,
+ * previous lap or torn by the crash) ends the ring.
+ */
+static void durable_ring_recover(struct durable_ring *d_ring)
+{
+	unsigned long long pos, start, newest = 0;
+	struct durable_hdr *hdr = d_ring->hdr;
+	struct durable_rec *rec;
+	size_t i;
+
+	for (i = 0; i < d_ring->size; i++) {
+		rec = (struct durable_rec *)(d_ring->slots + i * d_ring->stride);
+		if (rec->seq > newest && ((rec->seq - 1) & (d_ring->size - 1)) == i &&
+		    durable_rec_valid(d_ring, rec, rec->seq - 1))
+			newest = rec->seq;
+	}
+
+	start = hdr->tail;
+	if (newest > d_ring->size && newest - d_ring->size > start)
+		start = newest - d_ring->size;
+
+	for (pos = start; pos - start < d_ring->size; pos++)
+		if (!durable_rec_valid(d_ring, durable_rec_at(d_ring, pos), pos))
+			break;
+
+	hdr->tail = start;
+	hdr->head = pos;
+	d_ring->synced = pos;
+}
+
+/*
+ * Open (or create) a durable ring buffer. An existing file must have been
+ * created with the same elem_size and size, its unconsumed elements are
+ * recovered.
+ *
+ * @path:	File backing the ring
+ * @elem_size:	Sizeof elements
+ * @size:	Number of slots (power of 2)
+ * @flags:	RING_F_SPSC, DURABLE_F_FDATASYNC
+ * @batch:	Sync every batch puts (records) and gets (tail), 0 = only on
+ *		durable_ring_sync/durable_ring_free
+ */
+struct durable_ring *durable_ring_init(const char *path, size_t elem_size,
+				       size_t size, unsigned int flags,
+				       unsigned int batch)
+{
+	struct durable_ring *d_ring;
+	struct durable_hdr *hdr;
+	struct stat st;
+	void *map;
+	int fresh;
+
+	if (!is_power_of_2(size) || !elem_size) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	pthread_once(&crc32_once, crc32_init);
+
+	if (posix_memalign((void **)&d_ring, CACHE_LINE, sizeof(*d_ring))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+	memset(d_ring, 0, sizeof(*d_ring));
+
+	d_ring->flags = flags;
+	d_ring->batch = batch;
+	d_ring->elem_size = elem_size;
+	d_ring->size = size;
+	d_ring->stride = ALIGN(REC_HDR + elem_size, RING_SLOT_ALIGN);
+	d_ring->map_size = DURABLE_HDR_SIZE + size * d_ring->stride;
+
+	d_ring->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (d_ring->fd < 0) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+	if (fstat(d_ring->fd, &st)) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+	/* new file, the slots are zero (never written) */
+	if (!st.st_size && ftruncate(d_ring->fd, d_ring->map_size)) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+
+	map = mmap(NULL, d_ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   d_ring->fd, 0);
+	if (map == MAP_FAILED) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+	d_ring->hdr = hdr = map;
+	d_ring->slots = (char *)map + DURABLE_HDR_SIZE;
+
+	/* a crash between ftruncate and the header write leaves a full size
+	 * file with a zero header (slots zero too): still a new file
+	 */
+	fresh = !st.st_size ||
+		(st.st_size == d_ring->map_size &&
+		 !memcmp(hdr, &durable_hdr_zero, sizeof(*hdr)));
+	if (fresh) {
+		hdr->version = DURABLE_VERSION;
+		hdr->elem_size = elem_size;
+		hdr->size = size;
+		hdr->stride = d_ring->stride;
+		hdr->head = hdr->tail = 0;
+		/* magic last, a header without it is not valid */
+		hdr->magic = DURABLE_MAGIC;
+		if (durable_ring_flush(d_ring, 0, sizeof(*hdr))) {
+			ON_ERR(errno);
+			goto out_err_3;
+		}
+	} else if (st.st_size != d_ring->map_size ||
+		   hdr->magic != DURABLE_MAGIC ||
+		   hdr->version != DURABLE_VERSION ||
+		   hdr->elem_size != elem_size || hdr->size != size ||
+		   hdr->stride != d_ring->stride) {
+		ON_ERR(EINVAL);
+		goto out_err_3;
+	}
+
+	durable_ring_recover(d_ring);
+#ifdef MULTI_THREADING
+	if (pthread_mutex_init(&d_ring->w_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_3;
+	}
+	if (pthread_mutex_init(&d_ring->r_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_4;
+	}
+#endif
+
+	return d_ring;
+#ifdef MULTI_THREADING
+out_err_4:
+	pthread_mutex_destroy(&d_ring->w_mutex);
+#endif
+out_err_3:
+	munmap(map, d_ring->map_size);
+out_err_2:
+	close(d_ring->fd);
+out_err_1:
+	free(d_ring);
+out_err:
+	return NULL;
+}
+
+/*
+ * Sync and close a durable ring buffer. The file is kept.
+ */
+void durable_ring_free(struct durable_ring *d_ring)
+{
+	if (d_ring) {
+		if (durable_ring_sync(d_ring))
+			ON_ERR(errno);
+#ifdef MULTI_THREADING
+		if (pthread_mutex_destroy(&d_ring->w_mutex))
+			ON_ERR(errno);
+		if (pthread_mutex_destroy(&d_ring->r_mutex))
+			ON_ERR(errno);
+#endif
+		if (munmap(d_ring->hdr, d_ring->map_size))
+			ON_ERR(errno);
+		close(d_ring->fd);
+		free(d_ring);
+	}
+}
+
+/*
+ * Write back all the records added and the tail. Return 0 on success, -1
+ * with errno set otherwise.
+ *
+ * It works on the state of both sides: with RING_F_SPSC (no locks) call it
+ * only while neither the producer nor the consumer is running (after
+ * joining them, durable_ring_free does it), each side syncs its own part
+ * every batch puts/gets.
+ */
+int durable_ring_sync(struct durable_ring *d_ring)
+{
+	int err;
+
+	durable_ring_lock(d_ring, W_MUTEX(d_ring));
+	err = durable_ring_sync_records(d_ring);
+	durable_ring_unlock(d_ring, W_MUTEX(d_ring));
+
+	durable_ring_lock(d_ring, R_MUTEX(d_ring));
+	err |= durable_ring_sync_hdr(d_ring);
+	durable_ring_unlock(d_ring, R_MUTEX(d_ring));
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Number of elements in the ring (snapshot).
+ */
+unsigned long long durable_ring_count(struct durable_ring *d_ring)
+{
+	return smp_load_acquire(&d_ring->hdr->head) -
+	       smp_load_acquire(&d_ring->hdr->tail);
+}
+
+/*
+ * Add an element in ring buffer. The record is in the page cache when put
+ * returns, on the disk after the next sync (every batch puts).
+ *
+ * If the buffer is FULL, -1 is returned and the element is not added. On
+ * success, 0 is returned (also if the batch sync fails, errno is set).
+ */
+int durable_ring_put(struct durable_ring *d_ring, const void *elem)
+{
+	struct durable_hdr *hdr = d_ring->hdr;
+	struct durable_rec *rec;
+	unsigned long long head;
+
+	durable_ring_lock(d_ring, W_MUTEX(d_ring));
+
+	head = hdr->head;
+	if (head - smp_load_acquire(&hdr->tail) == d_ring->size) {
+		durable_ring_unlock(d_ring, W_MUTEX(d_ring));
+		return -1;
+	}
+
+	/* the sequence number tags the record as the one of head */
+	rec = durable_rec_at(d_ring, head);
+	rec->seq = head + 1;
+	memcpy(rec + 1, elem, d_ring->elem_size);
+	rec->crc = durable_rec_crc(d_ring, rec);
+	smp_store_release(&hdr->head, head + 1);
+
+	if (d_ring->batch && ++d_ring->puts >= d_ring->batch &&
+	    durable_ring_sync_records(d_ring))
+		ON_ERR(errno);
+
+	durable_ring_unlock(d_ring, W_MUTEX(d_ring));
+	return 0;
+}
+
+/*
+ * Extract an element from ring buffer. The slot is free for the writers
+ * right away, the new tail reaches the disk after the next sync.
+ *
+ * If buffer is EMPTY, -1 is returned and there is no value inside elem.
+ * On success, 0 is returned.
+ */
+int durable_ring_get(struct durable_ring *d_ring, void *elem)
+{
+	struct durable_hdr *hdr = d_ring->hdr;
+	unsigned long long tail;
+
+	durable_ring_lock(d_ring, R_MUTEX(d_ring));
+
+	tail = hdr->tail;
+	if (smp_load_acquire(&hdr->head) == tail) {
+		durable_ring_unlock(d_ring, R_MUTEX(d_ring));
+		return -1;
+	}
+
+	memcpy(elem, durable_rec_at(d_ring, tail) + 1, d_ring->elem_size);
+	smp_store_release(&hdr->tail, tail + 1);
+
+	if (d_ring->batch && ++d_ring->gets >= d_ring->batch &&
+	    durable_ring_sync_hdr(d_ring))
+		ON_ERR(errno);
+
+	durable_ring_unlock(d_ring, R_MUTEX(d_ring));
+	return 0;
+}
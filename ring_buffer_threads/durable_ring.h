@@ -0,0 +1,79 @@
+/* Durable (file backed) ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Ring whose header (head/tail) and slots live in a memory mapped file, so
+ * the elements survive a crash of the process. Writes reach the disk in
+ * batches (msync or fdatasync every batch puts/gets) and are recovered at
+ * init from the per record sequence numbers and checksums.
+ */
+#ifndef __DURABLE_RING_H__
+#define __DURABLE_RING_H__
+
+#include "buffer.h"
+
+#define DURABLE_MAGIC		0x52494e47	/* "RING" */
+#define DURABLE_VERSION		1
+#define DURABLE_HDR_SIZE	4096		/* header page, slots follow */
+
+/* Flags, on top of RING_F_SPSC */
+#define DURABLE_F_FDATASYNC	0x10000		/* fdatasync instead of msync */
+
+/*
+ * File header. Positions are 64 bit, they are never reset and also tag
+ * the records, so a record of a previous lap is never taken for a new one.
+ */
+struct durable_hdr {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned long long	elem_size;
+	unsigned long long	size;		/* slots, power of 2 */
+	unsigned long long	stride;		/* distance between records */
+	unsigned long long	head __cacheline_aligned; /* hint, see recovery */
+	unsigned long long	tail __cacheline_aligned; /* first unconsumed */
+};
+
+/* Record header, the element follows it */
+struct durable_rec {
+	unsigned long long	seq;		/* position + 1, 0 = never written */
+	unsigned int		crc;		/* crc32 of seq and element */
+	unsigned int		pad;
+};
+
+/*
+ * Writers are serialized by w_mutex and readers by r_mutex (MULTI_THREADING),
+ * RING_F_SPSC removes both locks (then durable_ring_sync may not run
+ * concurrently with put/get). Elements are delivered at least once: a
+ * crash after a get but before its tail reached the disk hands the element
+ * out again after recovery.
+ */
+struct durable_ring {
+	int			fd;
+	unsigned int		flags;
+	unsigned int		batch;		/* puts/gets between syncs, 0 = never */
+	size_t			elem_size;
+	size_t			size;
+	size_t			stride;
+	size_t			map_size;
+	struct durable_hdr	*hdr;		/* start of the mapping */
+	char			*slots;
+#ifdef MULTI_THREADING
+	pthread_mutex_t		w_mutex;	/* synchronize writers */
+	pthread_mutex_t		r_mutex;	/* synchronize readers */
+#endif
+	/* producer side */
+	unsigned long long	synced __cacheline_aligned; /* records on disk up to */
+	unsigned int		puts;		/* since last sync */
+	/* consumer side */
+	unsigned int		gets __cacheline_aligned; /* since last sync */
+};
+
+struct durable_ring *durable_ring_init(const char *path, size_t elem_size,
+				       size_t size, unsigned int flags,
+				       unsigned int batch);
+void durable_ring_free(struct durable_ring *d_ring);
+int durable_ring_put(struct durable_ring *d_ring, const void *elem);
+int durable_ring_get(struct durable_ring *d_ring, void *elem);
+int durable_ring_sync(struct durable_ring *d_ring);
+unsigned long long durable_ring_count(struct durable_ring *d_ring);
+
+#endif /* __DURABLE_RING_H__ */
@@ -0,0 +1,429 @@
+/* Work stealing task executor
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Deque operations follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli), tasks are two pointers
+ * copied with relaxed atomics since a thief may read a slot it then fails
+ * to claim.
+ */
+
+#include "limits.h"
+#include "executor.h"
+#include "futex.h"
+
+/* Worker running on this thread, NULL outside of the pools */
+static __thread struct exec_worker *exec_self;
+
+static int exec_deque_init(struct exec_deque *deque, size_t size)
+{
+	deque->tasks = malloc(size * sizeof(*deque->tasks));
+	if (!deque->tasks) {
+		ON_ERR(ENOMEM);
+		return -1;
+	}
+	deque->top = deque->bottom = 0;
+	deque->mask = size - 1;
+
+	return 0;
+}
+
+/*
+ * Owner only. Return 0 on success, -1 if the deque is FULL.
+ */
+static int exec_deque_push(struct exec_deque *deque, struct exec_task *task)
+{
+	struct exec_task *slot;
+	long b, t;
+
+	b = READ_ONCE(deque->bottom);
+	t = smp_load_acquire(&deque->top);
+	if (b - t > deque->mask)
+		return -1;
+
+	slot = &deque->tasks[b & deque->mask];
+	WRITE_ONCE(slot->fn, task->fn);
+	WRITE_ONCE(slot->arg, task->arg);
+	/* task visible before the new bottom */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	WRITE_ONCE(deque->bottom, b + 1);
+
+	return 0;
+}
+
+/*
+ * Owner only, newest task first. Return 0 on success, -1 if EMPTY.
+ */
+static int exec_deque_take(struct exec_deque *deque, struct exec_task *task)
+{
+	struct exec_task *slot;
+	long b, t;
+	int ret = 0;
+
+	b = READ_ONCE(deque->bottom) - 1;
+	WRITE_ONCE(deque->bottom, b);
+	/* thieves see the smaller bottom before we read top */
+	smp_mb();
+	t = READ_ONCE(deque->top);
+
+	if (t > b) {
+		WRITE_ONCE(deque->bottom, b + 1);
+		return -1;
+	}
+
+	slot = &deque->tasks[b & deque->mask];
+	task->fn = READ_ONCE(slot->fn);
+	task->arg = READ_ONCE(slot->arg);
+	if (t == b) {
+		/* last task, race the thieves for it */
+		if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+						 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			ret = -1;
+		WRITE_ONCE(deque->bottom, b + 1);
+	}
+
+	return ret;
+}
+
+/*
+ * Any thread, oldest task first. Return 0 on success, -1 if EMPTY or
+ * another thread took the task.
+ */
+static int exec_deque_steal(struct exec_deque *deque, struct exec_task *task)
+{
+	struct exec_task *slot;
+	long b, t;
+
+	t = smp_load_acquire(&deque->top);
+	smp_mb();
+	b = smp_load_acquire(&deque->bottom);
+	if (t >= b)
+		return -1;
+
+	slot = &deque->tasks[t & deque->mask];
+	task->fn = READ_ONCE(slot->fn);
+	task->arg = READ_ONCE(slot->arg);
+
+	return __atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+					   __ATOMIC_SEQ_CST,
+					   __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/*
+ * Wake one sleeping worker, if there is any. The full barrier orders the
+ * publish of the task before the read of sleepers, it pairs with the one
+ * in exec_worker_idle.
+ */
+static void executor_wake(struct executor *exec)
+{
+	smp_mb();
+	if (likely(!READ_ONCE(exec->sleepers)))
+		return;
+
+	__atomic_fetch_add(&exec->event, 1, __ATOMIC_RELEASE);
+	futex_wake(&exec->event, 1);
+}
+
+/*
+ * Find a task: own deque, then the injection ring, then steal from the
+ * other workers starting from a random one.
+ */
+static int exec_worker_find(struct exec_worker *worker, struct exec_task *task)
+{
+	struct executor *exec = worker->exec;
+	unsigned int i, victim;
+
+	if (!exec_deque_take(&worker->deque, task))
+		return 0;
+
+	if (!ring_buffer_get(exec->inject, task))
+		return 0;
+
+	worker->seed ^= worker->seed << 13;
+	worker->seed ^= worker->seed >> 17;
+	worker->seed ^= worker->seed << 5;
+	victim = worker->seed % exec->nr_workers;
+
+	for (i = 0; i < exec->nr_workers; i++, victim++) {
+		if (victim == exec->nr_workers)
+			victim = 0;
+		if (victim == worker->id)
+			continue;
+		if (!exec_deque_steal(&exec->workers[victim].deque, task))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Nothing to run: sleep until a task is published (or stop). Return 0 with
+ * a task found on the last check, -1 when the executor stops.
+ */
+static int exec_worker_idle(struct exec_worker *worker, struct exec_task *task)
+{
+	struct executor *exec = worker->exec;
+	unsigned int i, ev;
+
+	for (i = 0; i < RING_SPIN_MIN; i++) {
+		cpu_relax();
+		if (!exec_worker_find(worker, task))
+			return 0;
+	}
+
+	for (;;) {
+		__atomic_fetch_add(&exec->sleepers, 1, __ATOMIC_SEQ_CST);
+		ev = smp_load_acquire(&exec->event);
+		if (!exec_worker_find(worker, task)) {
+			__atomic_fetch_sub(&exec->sleepers, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		if (READ_ONCE(exec->stop)) {
+			__atomic_fetch_sub(&exec->sleepers, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+
+		/* the pool may be quiescent, let executor_wait check */
+		if (READ_ONCE(exec->waiters)) {
+			__atomic_fetch_add(&exec->idle_event, 1, __ATOMIC_RELEASE);
+			futex_wake(&exec->idle_event, INT_MAX);
+		}
+
+		futex_wait(&exec->event, ev, NULL);
+		__atomic_fetch_sub(&exec->sleepers, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *exec_worker_function(void *arg)
+{
+	struct exec_worker *worker = arg;
+	struct exec_task task;
+
+	exec_self = worker;
+
+	for (;;) {
+		if (exec_worker_find(worker, &task) &&
+		    exec_worker_idle(worker, &task))
+			break;
+
+		task.fn(task.arg);
+		__atomic_store_n(&worker->done, worker->done + 1, __ATOMIC_RELEASE);
+	}
+
+	exec_self = NULL;
+	return NULL;
+}
+
+/*
+ * Create an executor and start its workers.
+ *
+ * @nr_workers:		Number of worker threads
+ * @deque_size:		Tasks per worker deque (power of 2), 0 = EXEC_DEQUE_SIZE
+ * @inject_size:	Size of the injection ring (power of 2), 0 = EXEC_INJECT_SIZE
+ */
+struct executor *executor_init(unsigned int nr_workers, size_t deque_size,
+			       size_t inject_size)
+{
+	struct executor *exec;
+	unsigned int i;
+
+	if (!deque_size)
+		deque_size = EXEC_DEQUE_SIZE;
+	if (!inject_size)
+		inject_size = EXEC_INJECT_SIZE;
+	if (!nr_workers || !is_power_of_2(deque_size)) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	if (posix_memalign((void **)&exec, CACHE_LINE, sizeof(*exec))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+	memset(exec, 0, sizeof(*exec));
+	exec->nr_workers = nr_workers;
+
+	exec->inject = ring_buffer_init_flags(sizeof(struct exec_task),
+					      inject_size, RING_F_MPMC);
+	if (!exec->inject)
+		goto out_err_1;
+
+	if (posix_memalign((void **)&exec->workers, CACHE_LINE,
+			   nr_workers * sizeof(*exec->workers))) {
+		ON_ERR(ENOMEM);
+		goto out_err_2;
+	}
+	memset(exec->workers, 0, nr_workers * sizeof(*exec->workers));
+
+	for (i = 0; i < nr_workers; i++) {
+		exec->workers[i].exec = exec;
+		exec->workers[i].id = i;
+		exec->workers[i].seed = 2 * i + 1;
+		if (exec_deque_init(&exec->workers[i].deque, deque_size))
+			goto out_err_3;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(&exec->workers[i].thread, NULL,
+				   exec_worker_function, &exec->workers[i])) {
+			ON_ERR(errno);
+			goto out_err_4;
+		}
+	}
+
+	return exec;
+out_err_4:
+	WRITE_ONCE(exec->stop, 1);
+	__atomic_fetch_add(&exec->event, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&exec->event, INT_MAX);
+	while (i--)
+		pthread_join(exec->workers[i].thread, NULL);
+out_err_3:
+	for (i = 0; i < nr_workers; i++)
+		free(exec->workers[i].deque.tasks);
+	free(exec->workers);
+out_err_2:
+	ring_buffer_free(exec->inject);
+out_err_1:
+	free(exec);
+out_err:
+	return NULL;
+}
+
+/*
+ * Run all the submitted tasks, stop the workers and free the executor.
+ */
+void executor_free(struct executor *exec)
+{
+	unsigned int i;
+
+	if (exec) {
+		executor_wait(exec);
+
+		WRITE_ONCE(exec->stop, 1);
+		__atomic_fetch_add(&exec->event, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&exec->event, INT_MAX);
+		for (i = 0; i < exec->nr_workers; i++) {
+			if (pthread_join(exec->workers[i].thread, NULL))
+				ON_ERR(errno);
+			free(exec->workers[i].deque.tasks);
+		}
+
+		free(exec->workers);
+		ring_buffer_free(exec->inject);
+		free(exec);
+	}
+}
+
+/*
+ * Submit fn(arg). From a worker of the pool the task goes on the worker
+ * deque (or runs right away if the deque is FULL), from any other thread
+ * it goes through the injection ring.
+ *
+ * Return 0 on success, -1 with errno EAGAIN if the injection ring is FULL.
+ */
+int executor_submit(struct executor *exec, void (*fn)(void *), void *arg)
+{
+	struct exec_worker *worker = exec_self;
+	struct exec_task task = { fn, arg };
+
+	if (worker && worker->exec == exec) {
+		__atomic_store_n(&worker->submitted, worker->submitted + 1,
+				 __ATOMIC_SEQ_CST);
+		if (exec_deque_push(&worker->deque, &task)) {
+			fn(arg);
+			__atomic_store_n(&worker->done, worker->done + 1,
+					 __ATOMIC_RELEASE);
+			return 0;
+		}
+	} else {
+		/* counted before any worker can run (and count) it */
+		__atomic_fetch_add(&exec->submitted, 1, __ATOMIC_SEQ_CST);
+		if (ring_buffer_put(exec->inject, &task)) {
+			__atomic_fetch_sub(&exec->submitted, 1, __ATOMIC_SEQ_CST);
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	executor_wake(exec);
+	return 0;
+}
+
+/*
+ * All the tasks submitted so far ran. Done counters are read before the
+ * submitted ones: a task counted as done was counted as submitted before,
+ * together with every task it submitted itself.
+ */
+static int executor_quiescent(struct executor *exec)
+{
+	unsigned long done = 0, submitted;
+	unsigned int i;
+
+	for (i = 0; i < exec->nr_workers; i++)
+		done += __atomic_load_n(&exec->workers[i].done, __ATOMIC_SEQ_CST);
+
+	submitted = __atomic_load_n(&exec->submitted, __ATOMIC_SEQ_CST);
+	for (i = 0; i < exec->nr_workers; i++)
+		submitted += __atomic_load_n(&exec->workers[i].submitted,
+					     __ATOMIC_SEQ_CST);
+
+	return done == submitted;
+}
+
+/*
+ * Wait until all the tasks submitted so far (and the tasks they submit)
+ * ran. Must not be called from a worker of the pool.
+ */
+void executor_wait(struct executor *exec)
+{
+	unsigned int ev;
+
+	for (;;) {
+		__atomic_fetch_add(&exec->waiters, 1, __ATOMIC_SEQ_CST);
+		ev = smp_load_acquire(&exec->idle_event);
+		if (executor_quiescent(exec))
+			break;
+		futex_wait(&exec->idle_event, ev, NULL);
+		__atomic_fetch_sub(&exec->waiters, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_sub(&exec->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Index of the calling worker in exec, -1 if called from outside the pool.
+ */
+int executor_worker_id(struct executor *exec)
+{
+	struct exec_worker *worker = exec_self;
+
+	return worker && worker->exec == exec ? (int)worker->id : -1;
+}
+
+/*
+ * Pin the workers following policy (topology.h): worker i runs on the i-th
+ * CPU of the placement order, wrapping around when there are more workers
+ * than CPUs. TOPO_NONE gives them all the CPUs of the process back.
+ * Return 0 on success, -1 otherwise.
+ */
+int executor_place(struct executor *exec, enum topo_policy policy)
+{
+	int cpus[TOPO_MAX_CPUS], nr, err;
+	unsigned int i;
+
+	nr = topo_order(policy, cpus, TOPO_MAX_CPUS);
+	if (nr <= 0)
+		return -1;
+
+	for (i = 0; i < exec->nr_workers; i++) {
+		if (policy == TOPO_NONE)
+			err = topo_unpin(exec->workers[i].thread);
+		else
+			err = topo_pin(exec->workers[i].thread, cpus[i % nr]);
+		if (err) {
+			ON_ERR(err);
+			return -1;
+		}
+	}
+
+	return 0;
+}
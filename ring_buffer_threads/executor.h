@@ -0,0 +1,66 @@
+/* Work stealing task executor
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Fixed pool of workers. Every worker owns a deque (Chase-Lev): it pushes
+ * and pops tasks at the bottom, idle workers steal from the top. Tasks
+ * submitted from outside the pool go through a bounded MPMC injection ring.
+ * Workers only touch shared state when they run out of local work.
+ */
+#ifndef __EXECUTOR_H__
+#define __EXECUTOR_H__
+
+#include "buffer.h"
+#include "topology.h"
+
+#define EXEC_DEQUE_SIZE		1024	/* default tasks per worker deque */
+#define EXEC_INJECT_SIZE	1024	/* default injection ring size */
+
+struct exec_task {
+	void			(*fn)(void *);
+	void			*arg;
+};
+
+/*
+ * Chase-Lev deque of a fixed (power of 2) size. Only the owner moves
+ * bottom, thieves and the owner (last task) race on top with a CAS.
+ */
+struct exec_deque {
+	long			top __cacheline_aligned;
+	long			bottom __cacheline_aligned;
+	long			mask;
+	struct exec_task	*tasks;
+};
+
+struct exec_worker {
+	struct exec_deque	deque;
+	struct executor		*exec;
+	pthread_t		thread;
+	unsigned int		id;
+	unsigned int		seed;		/* victim selection */
+	unsigned long		submitted;	/* tasks pushed by this worker */
+	unsigned long		done;		/* tasks run by this worker */
+} __cacheline_aligned;
+
+struct executor {
+	unsigned int		nr_workers;
+	struct exec_worker	*workers;
+	struct ring_buffer	*inject;	/* submissions from outside */
+	/* tasks injected from outside the pool */
+	unsigned long		submitted __cacheline_aligned;
+	/* idle workers and executor_wait callers */
+	unsigned int		event __cacheline_aligned; /* futex, workers sleep on it */
+	unsigned int		sleepers;
+	unsigned int		idle_event;	/* futex, executor_wait sleeps on it */
+	unsigned int		waiters;
+	unsigned int		stop;
+};
+
+struct executor *executor_init(unsigned int nr_workers, size_t deque_size,
+			       size_t inject_size);
+void executor_free(struct executor *exec);
+int executor_submit(struct executor *exec, void (*fn)(void *), void *arg);
+void executor_wait(struct executor *exec);
+int executor_worker_id(struct executor *exec);
+int executor_place(struct executor *exec, enum topo_policy policy);
+
+#endif /* __EXECUTOR_H__ */
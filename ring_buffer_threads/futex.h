@@ -0,0 +1,55 @@
+/* Ring buffer design
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Thin wrappers over the futex system call, used to put threads to sleep
+ * until a 32 bit word changes.
+ */
+#ifndef __RING_FUTEX_H__
+#define __RING_FUTEX_H__
+
+#include "time.h"
+#include "errno.h"
+#include "unistd.h"
+#include "sys/syscall.h"
+#include "linux/futex.h"
+
+/*
+ * Sleep while *uaddr == val, at most until the CLOCK_MONOTONIC deadline
+ * (forever if NULL). Return 0 when woken (or *uaddr != val), -1 and errno
+ * set otherwise (ETIMEDOUT, EINTR).
+ */
+static inline int futex_wait(unsigned int *uaddr, unsigned int val,
+			     const struct timespec *deadline)
+{
+	/* FUTEX_WAIT_BITSET takes an absolute timeout */
+	if (syscall(SYS_futex, uaddr, FUTEX_WAIT_BITSET_PRIVATE, val, deadline,
+		    NULL, FUTEX_BITSET_MATCH_ANY) == -1)
+		return errno == EAGAIN ? 0 : -1;
+
+	return 0;
+}
+
+/*
+ * Wake up to nr threads sleeping on uaddr.
+ */
+static inline void futex_wake(unsigned int *uaddr, int nr)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/*
+ * Turn a relative timeout into a CLOCK_MONOTONIC deadline.
+ */
+static inline void futex_deadline(const struct timespec *timeout,
+				  struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout->tv_sec;
+	deadline->tv_nsec += timeout->tv_nsec;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_nsec -= 1000000000L;
+		deadline->tv_sec++;
+	}
+}
+
+#endif /* __RING_FUTEX_H__ */
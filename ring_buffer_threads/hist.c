@@ -0,0 +1,90 @@
+/* Log linear histogram
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "string.h"
+#include "hist.h"
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Copy the counters of h, while other threads may still add to it. The
+ * copy is not atomic as a whole, count is recomputed from the buckets so
+ * percentiles stay consistent.
+ */
+void hist_snapshot(const struct hist *h, struct hist *snap)
+{
+	unsigned int i;
+
+	snap->count = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		snap->buckets[i] = READ_ONCE(h->buckets[i]);
+		snap->count += snap->buckets[i];
+	}
+	snap->sum = READ_ONCE(h->sum);
+	snap->max = READ_ONCE(h->max);
+}
+
+/*
+ * Add the values of src to dst (one histogram per thread, merged for the
+ * report). Nobody may add to dst meanwhile.
+ */
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	struct hist snap;
+	unsigned int i;
+
+	hist_snapshot(src, &snap);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += snap.buckets[i];
+	dst->count += snap.count;
+	dst->sum += snap.sum;
+	if (snap.max > dst->max)
+		dst->max = snap.max;
+}
+
+/*
+ * Smallest value that goes in bucket.
+ */
+unsigned long hist_bucket_low(unsigned int bucket)
+{
+	unsigned int group = bucket >> HIST_SUB_BITS;
+
+	if (!group)
+		return bucket;
+
+	return (unsigned long)(HIST_SUB + (bucket & (HIST_SUB - 1))) << (group - 1);
+}
+
+/*
+ * Value below which p percent (0..100) of the values are, rounded up to
+ * the end of its bucket (capped to max). 0 if the histogram is empty.
+ */
+unsigned long hist_percentile(const struct hist *h, double p)
+{
+	unsigned long rank, seen = 0, high;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = (unsigned long)(p / 100.0 * h->count + 0.5);
+	if (!rank)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == HIST_BUCKETS)
+		return h->max;
+
+	high = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) - 1 : ~0UL;
+	return high < h->max ? high : h->max;
+}
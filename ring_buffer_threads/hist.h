@@ -0,0 +1,63 @@
+/* Log linear histogram
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Every power of 2 range of values is split in HIST_SUB linear buckets,
+ * so the relative error of a bucket is at most 1 / HIST_SUB whatever the
+ * magnitude (ns or ms), with a fixed number of buckets. Adding a value is
+ * a few instructions and relaxed atomic adds, no lock: any number of
+ * threads can add while another one reads. Keep one histogram per thread
+ * on hot paths and merge them, the adds are shared cache line writes.
+ *
+ * count is only kept by hist_snapshot/hist_merge (sum of the buckets),
+ * read percentiles from a snapshot or a merged histogram.
+ */
+#ifndef __RING_HIST_H__
+#define __RING_HIST_H__
+
+#include "compiler.h"
+
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)	/* buckets per power of 2 */
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	unsigned long		count;
+	unsigned long		sum;
+	unsigned long		max;
+	unsigned long		buckets[HIST_BUCKETS];
+};
+
+/*
+ * Values below HIST_SUB have a bucket each, then bucket group g covers
+ * [2^(g + HIST_SUB_BITS - 1), 2^(g + HIST_SUB_BITS)) in HIST_SUB steps.
+ */
+static inline unsigned int hist_bucket(unsigned long v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzl(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct hist *h, unsigned long v)
+{
+	unsigned long max = READ_ONCE(h->max);
+
+	__atomic_fetch_add(&h->buckets[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void hist_init(struct hist *h);
+void hist_snapshot(const struct hist *h, struct hist *snap);
+void hist_merge(struct hist *dst, const struct hist *src);
+unsigned long hist_bucket_low(unsigned int bucket);
+unsigned long hist_percentile(const struct hist *h, double p);
+
+#endif /* __RING_HIST_H__ */
@@ -0,0 +1,229 @@
+/* Latest value channel
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Writer: seq odd, release fence (the odd value is visible before any byte
+ * of the new value), copy, seq even with a release store. Reader: acquire
+ * load of an even seq, copy, acquire fence (the copy is done before seq is
+ * read again), same seq means nothing was written during the copy.
+ */
+
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "latest.h"
+
+/*
+ * Init a channel in mem, at least latest_size(elem_size) bytes aligned to
+ * CACHE_LINE (shared memory mapping, ...). Nothing is published yet.
+ */
+struct latest *latest_init_at(void *mem, size_t elem_size)
+{
+	struct latest *lt = mem;
+
+	if (!elem_size || ((unsigned long)mem & (CACHE_LINE - 1))) {
+		ON_ERR(EINVAL);
+		return NULL;
+	}
+
+	lt->elem_size = elem_size;
+	lt->seq = 0;
+	/* magic last, another process may look at it */
+	smp_store_release(&lt->magic, LATEST_MAGIC);
+
+	return lt;
+}
+
+/*
+ * Init a channel of elem_size values, for threads of this process.
+ */
+struct latest *latest_init(size_t elem_size)
+{
+	struct latest *lt;
+
+	if (!elem_size) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	if (posix_memalign((void **)&lt, CACHE_LINE, latest_size(elem_size))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+	memset(lt, 0, latest_size(elem_size));
+
+	return latest_init_at(lt, elem_size);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free a channel created with latest_init.
+ */
+void latest_free(struct latest *lt)
+{
+	free(lt);
+}
+
+/*
+ * Publish a new value. Only one thread (process) may write a channel, the
+ * readers are never waited for. The update starts from an even base, so a
+ * counter left odd by a writer that died mid-copy is picked up again.
+ */
+void latest_put(struct latest *lt, const void *elem)
+{
+	unsigned int seq = (READ_ONCE(lt->seq) + 1) & ~1u;
+
+	WRITE_ONCE(lt->seq, seq + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(lt->data, elem, lt->elem_size);
+	smp_store_release(&lt->seq, seq + 2);
+}
+
+/*
+ * Copy the newest value in elem. Return 0 on success, -1 if no value was
+ * published yet, LATEST_BUSY if one update did not end after LATEST_SPIN_MAX
+ * spins (writer dead or descheduled that long, try again later).
+ */
+int latest_get(struct latest *lt, void *elem)
+{
+	unsigned int seq, busy = 0, spins = 0;
+
+	for (;;) {
+		seq = smp_load_acquire(&lt->seq);
+		if (unlikely(seq & 1)) {
+			/* the writer is copying, a read now would be torn */
+			if (seq != busy) {
+				busy = seq;
+				spins = 0;
+			} else if (++spins == LATEST_SPIN_MAX) {
+				return LATEST_BUSY;
+			}
+			cpu_relax();
+			continue;
+		}
+		if (unlikely(!seq))
+			return -1;
+
+		memcpy(elem, lt->data, lt->elem_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (likely(READ_ONCE(lt->seq) == seq))
+			return 0;
+	}
+}
+
+/*
+ * Create the shared memory object name (must not exist) holding a channel
+ * of elem_size values and map it. Other processes attach with
+ * latest_shm_open.
+ */
+struct latest *latest_shm_create(const char *name, size_t elem_size)
+{
+	struct latest *lt;
+	void *map;
+	int fd;
+
+	if (!elem_size) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		ON_ERR(errno);
+		goto out_err;
+	}
+	if (ftruncate(fd, latest_size(elem_size))) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+
+	map = mmap(NULL, latest_size(elem_size), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+	/* the mapping stays valid without the descriptor */
+	close(fd);
+
+	lt = latest_init_at(map, elem_size);
+	if (!lt) {
+		munmap(map, latest_size(elem_size));
+		goto out_err_2;
+	}
+
+	return lt;
+out_err_1:
+	close(fd);
+out_err_2:
+	shm_unlink(name);
+out_err:
+	return NULL;
+}
+
+/*
+ * Map the channel created by another process with latest_shm_create.
+ * elem_size comes from the shared memory.
+ */
+struct latest *latest_shm_open(const char *name)
+{
+	struct latest *lt;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		ON_ERR(errno);
+		goto out_err;
+	}
+	if (fstat(fd, &st)) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+	if ((size_t)st.st_size < sizeof(struct latest)) {
+		ON_ERR(EINVAL);
+		goto out_err_1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+	close(fd);
+
+	lt = map;
+	/* not initialized yet, or not a channel */
+	if (smp_load_acquire(&lt->magic) != LATEST_MAGIC ||
+	    latest_size(lt->elem_size) != (size_t)st.st_size) {
+		ON_ERR(EINVAL);
+		munmap(map, st.st_size);
+		goto out_err;
+	}
+
+	return lt;
+out_err_1:
+	close(fd);
+out_err:
+	return NULL;
+}
+
+/*
+ * Unmap a channel returned by latest_shm_create/latest_shm_open.
+ */
+void latest_shm_close(struct latest *lt)
+{
+	if (lt && munmap(lt, latest_size(lt->elem_size)))
+		ON_ERR(errno);
+}
+
+/*
+ * Remove the shared memory object, the processes that mapped it keep it
+ * until they close it.
+ */
+int latest_shm_unlink(const char *name)
+{
+	return shm_unlink(name);
+}
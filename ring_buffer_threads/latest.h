@@ -0,0 +1,60 @@
+/* Latest value channel
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * One writer publishes elem_size bytes values (a configuration, the last
+ * price, ...), any number of readers get the newest one. Older values are
+ * overwritten, not queued.
+ *
+ * The value is protected by a sequence counter (seqlock): the writer makes
+ * it odd while it copies and even again when done, a reader copies the
+ * value and retries only if the counter was odd or changed meanwhile (torn
+ * read). The writer never waits for the readers and the readers never
+ * write to the shared memory.
+ *
+ * The structure holds no pointers, so it can be placed in memory shared
+ * between processes (latest_shm_create/latest_shm_open).
+ */
+#ifndef __LATEST_H__
+#define __LATEST_H__
+
+#include "buffer.h"
+
+#define LATEST_MAGIC	0x4c415354	/* "LAST" */
+#define LATEST_SPIN_MAX	(1 << 20)	/* latest_get spins on one update */
+#define LATEST_BUSY	-2		/* latest_get: writer stuck in an update */
+
+struct latest {
+	unsigned int		magic;		/* LATEST_MAGIC, checked on open */
+	size_t			elem_size;	/* sizeof values */
+	unsigned int		seq __cacheline_aligned; /* odd while written */
+	char			data[] __cacheline_aligned;
+};
+
+/* Bytes needed for a channel of elem_size values (see latest_init_at) */
+static inline size_t latest_size(size_t elem_size)
+{
+	return sizeof(struct latest) + ALIGN(elem_size, CACHE_LINE);
+}
+
+/* Number of values published so far, cheap way to poll for a new one */
+static inline unsigned int latest_version(struct latest *lt)
+{
+	return smp_load_acquire(&lt->seq) / 2;
+}
+
+struct latest *latest_init(size_t elem_size);
+struct latest *latest_init_at(void *mem, size_t elem_size);
+void latest_free(struct latest *lt);
+void latest_put(struct latest *lt, const void *elem);
+int latest_get(struct latest *lt, void *elem);
+/*
+ * POSIX shared memory, name as for shm_open ("/name"). A writer process that
+ * dies in the middle of latest_put leaves the counter odd for good: the
+ * readers get LATEST_BUSY from latest_get until a new writer publishes.
+ */
+struct latest *latest_shm_create(const char *name, size_t elem_size);
+struct latest *latest_shm_open(const char *name);
+void latest_shm_close(struct latest *lt);
+int latest_shm_unlink(const char *name);
+
+#endif /* __LATEST_H__ */
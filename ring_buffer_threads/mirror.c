@@ -0,0 +1,70 @@
+/* Mirrored memory for ring buffers
+ * Copyright (C) 2020 Lazar Razvan
+ */
+#define _GNU_SOURCE
+#include "unistd.h"
+#include "sys/mman.h"
+#include "buffer.h"
+#include "mirror.h"
+
+/*
+ * Map size bytes (multiple of the page size) twice, back to back. Return
+ * the address of the first copy, NULL on error.
+ *
+ * A PROT_NONE reservation of 2 * size first gets a free range of the
+ * address space, then both halves are replaced (MAP_FIXED) by shared
+ * mappings of the same memfd.
+ */
+void *mirror_map(size_t size)
+{
+	char *addr;
+	int fd;
+
+	if (!size || size % sysconf(_SC_PAGESIZE)) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	fd = memfd_create("ring_mirror", MFD_CLOEXEC);
+	if (fd < 0) {
+		ON_ERR(errno);
+		goto out_err;
+	}
+	if (ftruncate(fd, size)) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+
+	addr = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+
+	if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 fd, 0) == MAP_FAILED ||
+	    mmap(addr + size, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+
+	/* the mappings keep the memory alive */
+	close(fd);
+	return addr;
+out_err_2:
+	munmap(addr, 2 * size);
+out_err_1:
+	close(fd);
+out_err:
+	return NULL;
+}
+
+/*
+ * Unmap both copies of a mirror_map mapping.
+ */
+void mirror_unmap(void *addr, size_t size)
+{
+	if (addr && munmap(addr, 2 * size))
+		ON_ERR(errno);
+}
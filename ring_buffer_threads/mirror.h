@@ -0,0 +1,18 @@
+/* Mirrored memory for ring buffers
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * The same memory (a memfd) is mapped twice, back to back, in the virtual
+ * address space of the process (see tricks/giant.c for virtual vs resident
+ * memory and tricks/null.c for MAP_FIXED). Byte size + i is byte i, so
+ * anything up to size bytes starting anywhere in the first copy can be
+ * read or written as one contiguous span, even across the end of a ring.
+ */
+#ifndef __RING_MIRROR_H__
+#define __RING_MIRROR_H__
+
+#include "stddef.h"
+
+void *mirror_map(size_t size);
+void mirror_unmap(void *addr, size_t size);
+
+#endif /* __RING_MIRROR_H__ */
@@ -0,0 +1,207 @@
+/* Fixed size object pool
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Every change of the stack head increments its tag. A pop reads the head,
+ * walks up to POOL_BATCH links and swaps the head with a CAS: if the CAS
+ * succeeds the head (tag included) did not change since it was read, so
+ * nobody pushed or popped meanwhile and the walked links were the stack.
+ * The links of free objects are kept outside the objects (next), the pool
+ * never writes in an object.
+ */
+
+#include "obj_pool.h"
+
+static inline void pool_lock(struct pool_cache *cache)
+{
+	while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE))
+		while (READ_ONCE(cache->lock))
+			cpu_relax();
+}
+
+static inline int pool_trylock(struct pool_cache *cache)
+{
+	return !READ_ONCE(cache->lock) &&
+	       !__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void pool_unlock(struct pool_cache *cache)
+{
+	smp_store_release(&cache->lock, 0);
+}
+
+/*
+ * Pop up to n objects from the free stack in objs. Return how many.
+ */
+static unsigned int pool_pop(struct obj_pool *pool, unsigned int *objs,
+			     unsigned int n)
+{
+	unsigned long long head;
+	unsigned int idx, count;
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		idx = POOL_HEAD_IDX(head);
+		for (count = 0; idx != POOL_NONE && count < n; count++) {
+			objs[count] = idx;
+			idx = READ_ONCE(pool->next[idx - 1]);
+		}
+		if (!count)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&pool->head, &head,
+				POOL_HEAD(POOL_HEAD_TAG(head) + 1, idx), 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return count;
+}
+
+/*
+ * Push the n objects in objs on the free stack with one CAS.
+ */
+static void pool_push(struct obj_pool *pool, unsigned int *objs,
+		      unsigned int n)
+{
+	unsigned long long head;
+	unsigned int i;
+
+	for (i = 0; i < n - 1; i++)
+		WRITE_ONCE(pool->next[objs[i] - 1], objs[i + 1]);
+
+	head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+	do {
+		WRITE_ONCE(pool->next[objs[n - 1] - 1], POOL_HEAD_IDX(head));
+	} while (!__atomic_compare_exchange_n(&pool->head, &head,
+				POOL_HEAD(POOL_HEAD_TAG(head) + 1, objs[0]), 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * The stack is empty, take an object cached by another shard.
+ */
+static unsigned int pool_steal(struct obj_pool *pool, struct pool_cache *self)
+{
+	struct pool_cache *cache;
+	unsigned int i, idx = POOL_NONE;
+
+	for (i = 0; i < RING_SHARDS && idx == POOL_NONE; i++) {
+		cache = &pool->cache[i];
+		if (cache == self || !READ_ONCE(cache->count))
+			continue;
+		if (!pool_trylock(cache))
+			continue;
+		if (cache->count)
+			idx = cache->objs[--cache->count];
+		pool_unlock(cache);
+	}
+
+	return idx;
+}
+
+/*
+ * Init an object pool. All the memory is allocated (and touched) here,
+ * alloc/release never call malloc.
+ *
+ * @obj_size:	Sizeof objects
+ * @nr:		Number of objects
+ * @flags:	RING_F_CACHE_ALIGN to start every object on its own cache line
+ */
+struct obj_pool *obj_pool_init(size_t obj_size, unsigned int nr,
+			       unsigned int flags)
+{
+	struct obj_pool *pool;
+	unsigned int i;
+
+	if (!obj_size || !nr || nr == ~0U || (flags & ~RING_F_CACHE_ALIGN)) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	if (posix_memalign((void **)&pool, CACHE_LINE, sizeof(*pool))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+	memset(pool, 0, sizeof(*pool));
+
+	pool->obj_size = obj_size;
+	pool->stride = ALIGN(obj_size, (flags & RING_F_CACHE_ALIGN) ?
+					CACHE_LINE : RING_SLOT_ALIGN);
+	pool->nr = nr;
+
+	pool->next = (unsigned int *) malloc(nr * sizeof(*pool->next));
+	if (!pool->next) {
+		ON_ERR(ENOMEM);
+		goto out_err_1;
+	}
+
+	if (posix_memalign((void **)&pool->objs, CACHE_LINE, nr * pool->stride)) {
+		ON_ERR(ENOMEM);
+		goto out_err_2;
+	}
+	/* fault the pages in now, not on the first use of every object */
+	memset(pool->objs, 0, nr * pool->stride);
+
+	/* all the objects on the stack, 0 on top */
+	for (i = 0; i < nr - 1; i++)
+		pool->next[i] = i + 2;
+	pool->next[nr - 1] = POOL_NONE;
+	pool->head = POOL_HEAD(0, 1);
+
+	return pool;
+out_err_2:
+	free(pool->next);
+out_err_1:
+	free(pool);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free an object pool. No other thread may use it anymore.
+ */
+void obj_pool_free(struct obj_pool *pool)
+{
+	if (pool) {
+		free(pool->objs);
+		free(pool->next);
+		free(pool);
+	}
+}
+
+/*
+ * Take an object from the pool. Return NULL if all the objects are in use.
+ */
+void *obj_pool_alloc(struct obj_pool *pool)
+{
+	struct pool_cache *cache = &pool->cache[ring_thread_shard()];
+	unsigned int idx = POOL_NONE;
+
+	pool_lock(cache);
+	if (!cache->count)
+		cache->count = pool_pop(pool, cache->objs, POOL_BATCH);
+	if (cache->count)
+		idx = cache->objs[--cache->count];
+	pool_unlock(cache);
+
+	if (unlikely(idx == POOL_NONE)) {
+		idx = pool_steal(pool, cache);
+		if (idx == POOL_NONE)
+			return NULL;
+	}
+
+	return obj_pool_obj(pool, idx - 1);
+}
+
+/*
+ * Give back an object taken with obj_pool_alloc (by any thread).
+ */
+void obj_pool_release(struct obj_pool *pool, void *obj)
+{
+	struct pool_cache *cache = &pool->cache[ring_thread_shard()];
+
+	pool_lock(cache);
+	if (cache->count == POOL_CACHE) {
+		cache->count -= POOL_BATCH;
+		pool_push(pool, &cache->objs[cache->count], POOL_BATCH);
+	}
+	cache->objs[cache->count++] = obj_pool_index(pool, obj) + 1;
+	pool_unlock(cache);
+}
@@ -0,0 +1,63 @@
+/* Fixed size object pool
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Preallocated objects for messages too big to be copied through a ring:
+ * the producer takes an object from the pool, fills it and puts only its
+ * pointer (or index) in the ring, the consumer gives it back when done.
+ *
+ * Free objects are kept in a lock free stack (Treiber) of indexes, the head
+ * is tagged with a counter changed by every push/pop (no ABA). In front of
+ * it every thread shard (ring_thread_shard) has a small cache, so most
+ * alloc/release calls don't touch a shared cache line and the stack is
+ * accessed in batches.
+ */
+#ifndef __OBJ_POOL_H__
+#define __OBJ_POOL_H__
+
+#include "buffer.h"
+
+#define POOL_CACHE		32	/* objects cached per shard */
+#define POOL_BATCH		(POOL_CACHE / 2)	/* moved from/to the stack */
+
+#define POOL_NONE		0	/* end of the free stack */
+
+/* Head of the free stack: tag (high 32 bits), index + 1 (low 32 bits) */
+#define POOL_HEAD(tag, idx)	(((unsigned long long)(tag) << 32) | (idx))
+#define POOL_HEAD_TAG(head)	((unsigned int)((head) >> 32))
+#define POOL_HEAD_IDX(head)	((unsigned int)(head))
+
+struct pool_cache {
+	unsigned int		lock;		/* two threads may share a shard */
+	unsigned int		count;
+	unsigned int		objs[POOL_CACHE];	/* index + 1 */
+} __cacheline_aligned;
+
+struct obj_pool {
+	size_t			obj_size;	/* sizeof objects */
+	size_t			stride;		/* distance between objects */
+	unsigned int		nr;		/* number of objects */
+	unsigned int		*next;		/* free stack links (index + 1) */
+	char			*objs;		/* object arena */
+	struct pool_cache	cache[RING_SHARDS];
+	unsigned long long	head __cacheline_aligned;	/* free stack */
+};
+
+struct obj_pool *obj_pool_init(size_t obj_size, unsigned int nr,
+			       unsigned int flags);
+void obj_pool_free(struct obj_pool *pool);
+void *obj_pool_alloc(struct obj_pool *pool);
+void obj_pool_release(struct obj_pool *pool, void *obj);
+
+/* Index of obj in the pool (0 .. nr - 1), to pass through a ring */
+static inline unsigned int obj_pool_index(struct obj_pool *pool, void *obj)
+{
+	return ((char *)obj - pool->objs) / pool->stride;
+}
+
+/* Object with index idx */
+static inline void *obj_pool_obj(struct obj_pool *pool, unsigned int idx)
+{
+	return pool->objs + (size_t)idx * pool->stride;
+}
+
+#endif /* __OBJ_POOL_H__ */
@@ -0,0 +1,151 @@
+/* Multi priority ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "prio_ring.h"
+
+/*
+ * Init a priority ring.
+ *
+ * @levels:	Number of priority levels (0 is the highest)
+ * @elem_size:	Sizeof elements
+ * @size:	Size of each level ring (power of 2)
+ * @flags:	RING_F_* flags of the level rings (mode)
+ * @policy:	PRIO_STRICT or PRIO_WRR
+ * @weights:	PRIO_WRR: elements served from each level per round
+ */
+struct prio_ring *prio_ring_init(unsigned int levels, size_t elem_size,
+				 size_t size, unsigned int flags,
+				 unsigned int policy, const unsigned int *weights)
+{
+	struct prio_ring *p_ring;
+	int i;
+
+	if (!levels || levels > PRIO_RING_LEVELS ||
+	    (policy == PRIO_WRR && !weights)) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	p_ring = (struct prio_ring *) malloc(sizeof(*p_ring));
+	if (!p_ring) {
+		ON_ERR(errno);
+		goto out_err;
+	}
+
+	p_ring->levels = levels;
+	p_ring->policy = policy;
+	for (i = 0; i < levels; i++) {
+		p_ring->weight[i] = policy == PRIO_WRR ? weights[i] : 1;
+		p_ring->rings[i] = ring_buffer_init_flags(elem_size, size, flags);
+		if (!p_ring->rings[i])
+			goto out_err_1;
+	}
+
+	return p_ring;
+out_err_1:
+	for (i = i-1; i >= 0; i--)
+		ring_buffer_free(p_ring->rings[i]);
+	free(p_ring);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free a priority ring and all its levels.
+ */
+void prio_ring_free(struct prio_ring *p_ring)
+{
+	unsigned int i;
+
+	if (p_ring) {
+		for (i = 0; i < p_ring->levels; i++)
+			ring_buffer_free(p_ring->rings[i]);
+		free(p_ring);
+	}
+}
+
+/*
+ * Add an element with the given priority level. If that level is FULL, -1
+ * is returned and the element is not added. On success, 0 is returned.
+ */
+int prio_ring_put(struct prio_ring *p_ring, unsigned int level, void *elem)
+{
+	return ring_buffer_put(p_ring->rings[level], elem);
+}
+
+/*
+ * Start the weighted round robin of a consumer with the highest level.
+ */
+void prio_cursor_init(struct prio_ring *p_ring, struct prio_cursor *cursor)
+{
+	cursor->level = 0;
+	cursor->credit = p_ring->weight[0];
+}
+
+/*
+ * Number of elements waiting on a level. Lock free snapshot.
+ */
+unsigned int prio_ring_count(struct prio_ring *p_ring, unsigned int level)
+{
+	return ring_buffer_count(p_ring->rings[level]);
+}
+
+/*
+ * Strict priority: the highest level that has an element. Empty levels are
+ * skipped by looking at their head/tail only.
+ */
+static int prio_ring_get_strict(struct prio_ring *p_ring, void *elem)
+{
+	unsigned int i;
+
+	for (i = 0; i < p_ring->levels; i++)
+		if (ring_buffer_count(p_ring->rings[i]) &&
+		    !ring_buffer_get(p_ring->rings[i], elem))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Weighted round robin: serve up to weight[level] elements from a level
+ * before moving to the next one. Empty levels give their turn away, so no
+ * time is lost while the other levels have elements.
+ */
+static int prio_ring_get_wrr(struct prio_ring *p_ring,
+			     struct prio_cursor *cursor, void *elem)
+{
+	unsigned int i, level;
+
+	/* every level gets a chance, the current one twice if out of credit */
+	for (i = 0; i <= p_ring->levels; i++) {
+		level = cursor->level;
+		if (cursor->credit && ring_buffer_count(p_ring->rings[level]) &&
+		    !ring_buffer_get(p_ring->rings[level], elem)) {
+			cursor->credit--;
+			return level;
+		}
+
+		if (++cursor->level == p_ring->levels)
+			cursor->level = 0;
+		cursor->credit = p_ring->weight[cursor->level];
+	}
+
+	return -1;
+}
+
+/*
+ * Extract an element following the ring policy. cursor holds the weighted
+ * round robin state of the calling consumer (may be NULL with PRIO_STRICT).
+ *
+ * Return the level of the extracted element. If all the levels are EMPTY,
+ * -1 is returned.
+ */
+int prio_ring_get(struct prio_ring *p_ring, struct prio_cursor *cursor,
+		  void *elem)
+{
+	if (p_ring->policy == PRIO_WRR)
+		return prio_ring_get_wrr(p_ring, cursor, elem);
+
+	return prio_ring_get_strict(p_ring, elem);
+}
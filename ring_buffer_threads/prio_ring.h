@@ -0,0 +1,41 @@
+/* Multi priority ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * K bounded rings, one per priority level (0 is the highest). Urgent
+ * elements don't wait behind a ring full of bulk ones.
+ */
+#ifndef __PRIO_RING_H__
+#define __PRIO_RING_H__
+
+#include "buffer.h"
+
+#define PRIO_RING_LEVELS	8	/* max number of levels */
+
+/* Dequeue policy */
+#define PRIO_STRICT	0	/* always the highest non empty level */
+#define PRIO_WRR	1	/* weighted round robin over the levels */
+
+struct prio_ring {
+	unsigned int		levels;
+	unsigned int		policy;		/* PRIO_STRICT, PRIO_WRR */
+	unsigned int		weight[PRIO_RING_LEVELS];
+	struct ring_buffer	*rings[PRIO_RING_LEVELS];
+};
+
+/* Weighted round robin position, one per consumer thread */
+struct prio_cursor {
+	unsigned int		level;		/* level being served */
+	unsigned int		credit;		/* elements left for it */
+};
+
+struct prio_ring *prio_ring_init(unsigned int levels, size_t elem_size,
+				 size_t size, unsigned int flags,
+				 unsigned int policy, const unsigned int *weights);
+void prio_ring_free(struct prio_ring *p_ring);
+int prio_ring_put(struct prio_ring *p_ring, unsigned int level, void *elem);
+int prio_ring_get(struct prio_ring *p_ring, struct prio_cursor *cursor,
+		  void *elem);
+void prio_cursor_init(struct prio_ring *p_ring, struct prio_cursor *cursor);
+unsigned int prio_ring_count(struct prio_ring *p_ring, unsigned int level);
+
+#endif /* __PRIO_RING_H__ */
@@ -0,0 +1,344 @@
+/* Online resizable ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Entering a node is: increment the shard counter, then check that the node
+ * is still usable (not sealed for producers). Sealing is: change the node
+ * state, then look at the counters. All these accesses are sequentially
+ * consistent, so either the thread sees the new state and leaves, or the
+ * other side sees the thread.
+ *
+ * Freeing nodes uses two grace periods (as SRCU): put/get count themselves
+ * in active[shard].count[gp & 1] before they load prod/cons. A node consumers
+ * went past is retired in the current grace period gp; nobody can load it
+ * anymore, but threads that entered before may still use it. gp is advanced
+ * only once nobody is counted in the parity of the previous grace period, so
+ * two advances after the retirement mean all these threads left.
+ */
+
+#include "resize_ring.h"
+
+static struct resize_node *resize_node_alloc(struct resize_ring *rs_ring,
+					     size_t size)
+{
+	struct resize_node *node;
+
+	if (posix_memalign((void **)&node, CACHE_LINE, sizeof(*node))) {
+		ON_ERR(ENOMEM);
+		return NULL;
+	}
+	memset(node, 0, sizeof(*node));
+
+	node->ring = ring_buffer_init_flags(rs_ring->elem_size, size,
+					    rs_ring->flags);
+	if (!node->ring) {
+		free(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+static unsigned int resize_node_writers(struct resize_node *node)
+{
+	unsigned int i, sum = 0;
+
+	for (i = 0; i < RING_SHARDS; i++)
+		sum += __atomic_load_n(&node->count[i].writers, __ATOMIC_SEQ_CST);
+
+	return sum;
+}
+
+/*
+ * Count the caller in the current grace period, before it loads prod/cons.
+ * Return the counter to pass to resize_ring_exit.
+ */
+static inline unsigned int *resize_ring_enter(struct resize_ring *rs_ring)
+{
+	struct resize_epoch *epoch = &rs_ring->active[ring_thread_shard()];
+	unsigned int *count;
+
+	count = &epoch->count[__atomic_load_n(&rs_ring->gp, __ATOMIC_SEQ_CST) & 1];
+	__atomic_fetch_add(count, 1, __ATOMIC_SEQ_CST);
+
+	return count;
+}
+
+static inline void resize_ring_exit(unsigned int *count)
+{
+	__atomic_fetch_sub(count, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int resize_ring_active(struct resize_ring *rs_ring,
+				       unsigned int idx)
+{
+	unsigned int i, sum = 0;
+
+	for (i = 0; i < RING_SHARDS; i++)
+		sum += __atomic_load_n(&rs_ring->active[i].count[idx],
+				       __ATOMIC_SEQ_CST);
+
+	return sum;
+}
+
+/*
+ * Retire the nodes consumers went past, advance the grace period if the
+ * threads of the previous one left and free (from oldest) the nodes retired
+ * two grace periods ago. Never waits: what can't be freed yet is freed by a
+ * later call. resize_mutex held.
+ */
+static void resize_ring_reclaim(struct resize_ring *rs_ring)
+{
+	struct resize_node *node, *cons;
+	unsigned int i;
+
+	cons = __atomic_load_n(&rs_ring->cons, __ATOMIC_SEQ_CST);
+	for (node = rs_ring->oldest; node != cons; node = node->next)
+		if (!node->retired) {
+			node->retired = 1;
+			node->retired_gp = rs_ring->gp;
+		}
+
+	for (i = 0; i < 2; i++) {
+		if (resize_ring_active(rs_ring, (rs_ring->gp + 1) & 1))
+			break;
+		__atomic_store_n(&rs_ring->gp, rs_ring->gp + 1, __ATOMIC_SEQ_CST);
+	}
+
+	while ((node = rs_ring->oldest) != cons && node->retired &&
+	       rs_ring->gp - node->retired_gp >= 2) {
+		rs_ring->oldest = node->next;
+		ring_buffer_free(node->ring);
+		free(node);
+	}
+}
+
+/*
+ * Init a resizable ring buffer.
+ *
+ * @elem_size:	Sizeof elements
+ * @size:	Initial size (power of 2), also the lower bound of trim
+ * @flags:	RING_F_* flags of the rings (mode)
+ * @max_size:	Grow automatically (x2) when FULL, up to max_size. 0 = never
+ */
+struct resize_ring *resize_ring_init(size_t elem_size, size_t size,
+				     unsigned int flags, size_t max_size)
+{
+	struct resize_ring *rs_ring;
+
+	if (posix_memalign((void **)&rs_ring, CACHE_LINE, sizeof(*rs_ring))) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+
+	memset(rs_ring, 0, sizeof(*rs_ring));
+	rs_ring->elem_size = elem_size;
+	rs_ring->max_size = max_size;
+	rs_ring->min_size = size;
+	rs_ring->flags = flags;
+	rs_ring->oldest = resize_node_alloc(rs_ring, size);
+	if (!rs_ring->oldest)
+		goto out_err_1;
+	rs_ring->prod = rs_ring->cons = rs_ring->oldest;
+
+	if (pthread_mutex_init(&rs_ring->resize_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+
+	return rs_ring;
+out_err_2:
+	ring_buffer_free(rs_ring->oldest->ring);
+	free(rs_ring->oldest);
+out_err_1:
+	free(rs_ring);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free a resizable ring buffer. No other thread may use it anymore.
+ */
+void resize_ring_free(struct resize_ring *rs_ring)
+{
+	struct resize_node *node, *next;
+
+	if (rs_ring) {
+		for (node = rs_ring->oldest; node; node = next) {
+			next = node->next;
+			ring_buffer_free(node->ring);
+			free(node);
+		}
+		if (pthread_mutex_destroy(&rs_ring->resize_mutex))
+			ON_ERR(errno);
+		free(rs_ring);
+	}
+}
+
+/*
+ * Switch producers to a new ring of size elements. resize_mutex held.
+ */
+static int __resize_ring_resize(struct resize_ring *rs_ring, size_t size)
+{
+	struct resize_node *node, *prod = rs_ring->prod;
+
+	node = resize_node_alloc(rs_ring, size);
+	if (!node)
+		return -1;
+
+	/* consumers find next once they see sealed, producers find the new
+	 * prod once they see sealed
+	 */
+	smp_store_release(&prod->next, node);
+	smp_store_release(&rs_ring->prod, node);
+	__atomic_store_n(&prod->sealed, 1, __ATOMIC_SEQ_CST);
+
+	resize_ring_reclaim(rs_ring);
+	return 0;
+}
+
+/*
+ * Resize the ring to size elements (power of 2). Elements already in the
+ * ring stay where they are and are extracted first. Return 0 on success,
+ * -1 otherwise.
+ */
+int resize_ring_resize(struct resize_ring *rs_ring, size_t size)
+{
+	int err;
+
+	pthread_mutex_lock(&rs_ring->resize_mutex);
+	err = __resize_ring_resize(rs_ring, size);
+	pthread_mutex_unlock(&rs_ring->resize_mutex);
+
+	return err;
+}
+
+/*
+ * Shrink the ring when it is at most a quarter full: the new size is twice
+ * the current number of elements (at least the initial size). Return 0 on
+ * success or if there is nothing to do, -1 otherwise.
+ */
+int resize_ring_trim(struct resize_ring *rs_ring)
+{
+	size_t used = 0, size;
+	struct resize_node *node;
+	int err = 0;
+
+	pthread_mutex_lock(&rs_ring->resize_mutex);
+
+	for (node = rs_ring->cons; node; node = node->next)
+		used += ring_buffer_count(node->ring);
+
+	for (size = rs_ring->min_size; size < 2 * used; size *= 2)
+		;
+	if (size <= rs_ring->prod->ring->size / 4)
+		err = __resize_ring_resize(rs_ring, size);
+
+	pthread_mutex_unlock(&rs_ring->resize_mutex);
+	return err;
+}
+
+/*
+ * Size of the ring producers are adding to.
+ */
+size_t resize_ring_size(struct resize_ring *rs_ring)
+{
+	unsigned int *epoch = resize_ring_enter(rs_ring);
+	size_t size;
+
+	size = __atomic_load_n(&rs_ring->prod, __ATOMIC_SEQ_CST)->ring->size;
+	resize_ring_exit(epoch);
+
+	return size;
+}
+
+/*
+ * Add an element in ring buffer.
+ *
+ * If the buffer is FULL and can't grow anymore, -1 is returned and the
+ * element is not added. On success, 0 is returned.
+ */
+int resize_ring_put(struct resize_ring *rs_ring, void *elem)
+{
+	struct resize_count *count;
+	struct resize_node *node;
+	unsigned int *epoch;
+	size_t size;
+	int ret;
+
+	for (;;) {
+		epoch = resize_ring_enter(rs_ring);
+		node = __atomic_load_n(&rs_ring->prod, __ATOMIC_SEQ_CST);
+		count = &node->count[ring_thread_shard()];
+
+		__atomic_fetch_add(&count->writers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&node->sealed, __ATOMIC_SEQ_CST)) {
+			/* resized meanwhile, go to the new ring */
+			__atomic_fetch_sub(&count->writers, 1, __ATOMIC_RELEASE);
+			resize_ring_exit(epoch);
+			continue;
+		}
+		ret = ring_buffer_put(node->ring, elem);
+		size = node->ring->size;
+		__atomic_fetch_sub(&count->writers, 1, __ATOMIC_RELEASE);
+
+		if (!ret || !rs_ring->max_size || size >= rs_ring->max_size) {
+			resize_ring_exit(epoch);
+			return ret;
+		}
+
+		/* high water: grow, unless somebody else is doing it. Still
+		 * inside, node can't be freed and reused for a new prod
+		 */
+		if (pthread_mutex_trylock(&rs_ring->resize_mutex)) {
+			resize_ring_exit(epoch);
+			continue;
+		}
+		if (rs_ring->prod == node)
+			ret = __resize_ring_resize(rs_ring, 2 * size);
+		else
+			ret = 0;
+		pthread_mutex_unlock(&rs_ring->resize_mutex);
+		resize_ring_exit(epoch);
+		if (ret)
+			return -1;
+	}
+}
+
+/*
+ * Extract an element from ring buffer.
+ *
+ * If buffer is EMPTY, -1 is returned and there is no value inside elem.
+ * On success, 0 is returned.
+ */
+int resize_ring_get(struct resize_ring *rs_ring, void *elem)
+{
+	struct resize_node *node;
+	unsigned int *epoch;
+	int ret;
+
+	for (;;) {
+		epoch = resize_ring_enter(rs_ring);
+		node = __atomic_load_n(&rs_ring->cons, __ATOMIC_SEQ_CST);
+
+		ret = ring_buffer_get(node->ring, elem);
+		if (ret && __atomic_load_n(&node->sealed, __ATOMIC_SEQ_CST) &&
+		    !resize_node_writers(node)) {
+			/* no more producers, last look before moving on */
+			ret = ring_buffer_get(node->ring, elem);
+			if (ret) {
+				__atomic_compare_exchange_n(&rs_ring->cons, &node,
+						node->next, 0, __ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST);
+				resize_ring_exit(epoch);
+				if (!pthread_mutex_trylock(&rs_ring->resize_mutex)) {
+					resize_ring_reclaim(rs_ring);
+					pthread_mutex_unlock(&rs_ring->resize_mutex);
+				}
+				continue;
+			}
+		}
+		resize_ring_exit(epoch);
+
+		return ret;
+	}
+}
@@ -0,0 +1,60 @@
+/* Online resizable ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Chain of ring_buffer rings. Producers add to the newest ring, consumers
+ * drain the oldest one. Resizing appends a new ring of the wanted size and
+ * seals the current one: producers move to the new ring right away, readers
+ * move once the sealed ring is empty, so the order is preserved and nobody
+ * stops while the ring grows or shrinks. A drained node (ring and node
+ * structure) is freed once no thread that could have seen it is still
+ * inside resize_ring_put/get.
+ */
+#ifndef __RESIZE_RING_H__
+#define __RESIZE_RING_H__
+
+#include "buffer.h"
+
+/* Producers working on a node, sharded per thread (ring_thread_shard) */
+struct resize_count {
+	unsigned int		writers;	/* producers inside the node */
+} __cacheline_aligned;
+
+/* Threads inside put/get, per grace period parity, sharded per thread */
+struct resize_epoch {
+	unsigned int		count[2];
+} __cacheline_aligned;
+
+struct resize_node {
+	struct ring_buffer	*ring;
+	struct resize_node	*next;		/* newer ring */
+	unsigned int		sealed;		/* no more producers allowed */
+	unsigned int		retired;	/* consumers went past it */
+	unsigned int		retired_gp;	/* grace period it was retired in */
+	struct resize_count	count[RING_SHARDS];
+};
+
+struct resize_ring {
+	size_t			elem_size;	/* sizeof elements in buffer */
+	size_t			max_size;	/* grow on FULL up to it, 0 = never */
+	size_t			min_size;	/* resize_ring_trim lower bound */
+	unsigned int		flags;		/* RING_F_* flags of the rings */
+	pthread_mutex_t		resize_mutex;	/* serialize resizers */
+	struct resize_node	*oldest;	/* all the nodes, oldest first */
+	unsigned int		gp;		/* current grace period */
+	struct resize_epoch	active[RING_SHARDS];
+	/* producer side */
+	struct resize_node	*prod __cacheline_aligned;
+	/* consumer side */
+	struct resize_node	*cons __cacheline_aligned;
+};
+
+struct resize_ring *resize_ring_init(size_t elem_size, size_t size,
+				     unsigned int flags, size_t max_size);
+void resize_ring_free(struct resize_ring *rs_ring);
+int resize_ring_put(struct resize_ring *rs_ring, void *elem);
+int resize_ring_get(struct resize_ring *rs_ring, void *elem);
+int resize_ring_resize(struct resize_ring *rs_ring, size_t size);
+int resize_ring_trim(struct resize_ring *rs_ring);
+size_t resize_ring_size(struct resize_ring *rs_ring);
+
+#endif /* __RESIZE_RING_H__ */
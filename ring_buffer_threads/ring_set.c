@@ -0,0 +1,191 @@
+/* Set of per producer rings
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "ring_set.h"
+
+/*
+ * Init a set of nr rings, one per producer.
+ *
+ * @nr:		Number of producers
+ * @elem_size:	Sizeof elements
+ * @size:	Size of each ring (power of 2)
+ * @flags:	Extra RING_F_* flags for the rings (RING_F_SPSC is implied)
+ */
+struct ring_set *ring_set_init(unsigned int nr, size_t elem_size, size_t size,
+			       unsigned int flags)
+{
+	struct ring_set *r_set;
+	int i;
+
+	if (!nr || (flags & RING_F_MPMC)) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	r_set = (struct ring_set *) malloc(sizeof(*r_set));
+	if (!r_set) {
+		ON_ERR(errno);
+		goto out_err;
+	}
+
+	r_set->rings = (struct ring_buffer **) malloc(nr * sizeof(*r_set->rings));
+	if (!r_set->rings) {
+		ON_ERR(errno);
+		goto out_err_1;
+	}
+	for (i = 0; i < nr; i++) {
+		r_set->rings[i] = ring_buffer_init_flags(elem_size, size,
+							 flags | RING_F_SPSC);
+		if (!r_set->rings[i])
+			goto out_err_2;
+	}
+
+	r_set->nr = nr;
+	r_set->attached = 0;
+
+	return r_set;
+out_err_2:
+	for (i = i-1; i >= 0; i--)
+		ring_buffer_free(r_set->rings[i]);
+	free(r_set->rings);
+out_err_1:
+	free(r_set);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free the set and all its rings.
+ */
+void ring_set_free(struct ring_set *r_set)
+{
+	unsigned int i;
+
+	if (r_set) {
+		for (i = 0; i < r_set->nr; i++)
+			ring_buffer_free(r_set->rings[i]);
+		free(r_set->rings);
+		free(r_set);
+	}
+}
+
+/*
+ * Give the calling producer its own ring. Return the producer index to be
+ * used with ring_set_put/ring_set_ring, -1 if all the rings are taken.
+ */
+int ring_set_attach(struct ring_set *r_set)
+{
+	unsigned int idx;
+
+	idx = __atomic_fetch_add(&r_set->attached, 1, __ATOMIC_RELAXED);
+	if (idx >= r_set->nr) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return idx;
+}
+
+/*
+ * Ring of a producer, to use the rest of the ring API (bulk, zero copy,
+ * blocking) on it. Only the owner producer may add elements.
+ */
+struct ring_buffer *ring_set_ring(struct ring_set *r_set, unsigned int producer)
+{
+	return r_set->rings[producer];
+}
+
+/*
+ * Add an element in the ring of producer. Same return values as
+ * ring_buffer_put.
+ */
+int ring_set_put(struct ring_set *r_set, unsigned int producer, void *elem)
+{
+	return ring_buffer_put(r_set->rings[producer], elem);
+}
+
+/*
+ * Give consumer (0..nr_consumers - 1) its share of the rings. The rings are
+ * split in contiguous, disjoint ranges of (almost) the same size.
+ *
+ * Return 0 on success, -1 with errno EINVAL if nr_consumers is 0 or
+ * consumer is out of range.
+ */
+int ring_set_cursor_init(struct ring_set *r_set, struct ring_set_cursor *cursor,
+			 unsigned int consumer, unsigned int nr_consumers)
+{
+	unsigned int share, extra;
+
+	if (!nr_consumers || consumer >= nr_consumers) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	share = r_set->nr / nr_consumers;
+	extra = r_set->nr % nr_consumers;
+
+	/* the first extra consumers get one more ring */
+	cursor->first = consumer * share + (consumer < extra ? consumer : extra);
+	cursor->count = share + (consumer < extra);
+	cursor->next = 0;
+	return 0;
+}
+
+/*
+ * Extract one element from the rings of cursor, visiting them round robin:
+ * the next call starts with the ring after the one that gave the element.
+ *
+ * If all the rings are EMPTY, -1 is returned. On success, 0 is returned.
+ */
+int ring_set_get(struct ring_set *r_set, struct ring_set_cursor *cursor,
+		 void *elem)
+{
+	unsigned int i, idx;
+
+	for (i = 0; i < cursor->count; i++) {
+		idx = cursor->next;
+		if (++cursor->next == cursor->count)
+			cursor->next = 0;
+		if (!ring_buffer_get(r_set->rings[cursor->first + idx], elem))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Extract up to n elements from the rings of cursor (batch fair): every ring
+ * gives at most quantum elements per round, rounds go on until n elements
+ * are collected or a whole round finds all rings EMPTY. Elements of one
+ * producer keep their order. Return the number of elements extracted.
+ */
+unsigned int ring_set_get_burst(struct ring_set *r_set,
+				struct ring_set_cursor *cursor, void *elems,
+				unsigned int n, unsigned int quantum)
+{
+	unsigned int i, idx, cnt, got = 0, round;
+	struct ring_buffer *r_buffer;
+
+	if (!cursor->count)
+		return 0;
+
+	do {
+		round = 0;
+		for (i = 0; i < cursor->count && got < n; i++) {
+			idx = cursor->next;
+			if (++cursor->next == cursor->count)
+				cursor->next = 0;
+
+			r_buffer = r_set->rings[cursor->first + idx];
+			cnt = n - got < quantum ? n - got : quantum;
+			cnt = ring_buffer_get_burst(r_buffer,
+					(char *)elems + got * r_buffer->elem_size,
+					cnt);
+			got += cnt;
+			round += cnt;
+		}
+	} while (round && got < n);
+
+	return got;
+}
@@ -0,0 +1,41 @@
+/* Set of per producer rings
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Every producer owns a SPSC ring, so writers never share a head index.
+ * Consumers drain the rings round robin. Several consumers can work on the
+ * same set as long as each one owns a disjoint subset of the rings (see
+ * ring_set_cursor_init), a ring always has one reader.
+ */
+#ifndef __RING_SET_H__
+#define __RING_SET_H__
+
+#include "buffer.h"
+
+struct ring_set {
+	unsigned int		nr;		/* number of rings/producers */
+	unsigned int		attached;	/* producers attached so far */
+	struct ring_buffer	**rings;
+};
+
+/* Consumer position, one per consumer thread */
+struct ring_set_cursor {
+	unsigned int		first;		/* first ring owned */
+	unsigned int		count;		/* number of rings owned */
+	unsigned int		next;		/* next ring to visit (0..count) */
+};
+
+struct ring_set *ring_set_init(unsigned int nr, size_t elem_size, size_t size,
+			       unsigned int flags);
+void ring_set_free(struct ring_set *r_set);
+int ring_set_attach(struct ring_set *r_set);
+struct ring_buffer *ring_set_ring(struct ring_set *r_set, unsigned int producer);
+int ring_set_put(struct ring_set *r_set, unsigned int producer, void *elem);
+int ring_set_cursor_init(struct ring_set *r_set, struct ring_set_cursor *cursor,
+			 unsigned int consumer, unsigned int nr_consumers);
+int ring_set_get(struct ring_set *r_set, struct ring_set_cursor *cursor,
+		 void *elem);
+unsigned int ring_set_get_burst(struct ring_set *r_set,
+				struct ring_set_cursor *cursor, void *elems,
+				unsigned int n, unsigned int quantum);
+
+#endif /* __RING_SET_H__ */
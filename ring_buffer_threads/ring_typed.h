@@ -0,0 +1,170 @@
+/* Type specialized ring buffers
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Generate a ring for one element type and one capacity, in the style of
+ * tricks/func_generator.c. The capacity is a compile time power of 2 and
+ * elements are moved by assignment, so the compiler emits fixed size moves
+ * and mask arithmetic instead of memcpy(elem_size) and loads of size/mask.
+ * All the functions are static inline, they disappear in the callers.
+ *
+ *	DEFINE_RING(msg_ring, struct msg, 1024)
+ *
+ *	struct msg_ring *r = msg_ring_create();
+ *	msg_ring_put(r, &m);
+ *	msg_ring_get(r, &m);
+ *
+ * DEFINE_RING is one writer/one reader (same rules as RING_F_SPSC),
+ * DEFINE_RING_MPMC any number of writers/readers (RING_F_MPMC). The void *
+ * API of buffer.h stays the choice for sizes only known at run time.
+ *
+ * Inspect the generated code with: gcc -E file.c, and the moves with
+ * gcc -O2 -S file.c (the compiler decides: small types become a few
+ * loads/stores, large ones an inline block copy or a memcpy call of
+ * constant size).
+ */
+#ifndef __RING_TYPED_H__
+#define __RING_TYPED_H__
+
+#include "stdlib.h"
+#include "compiler.h"
+
+#define RING_TYPED_CHECK(name, capacity) \
+_Static_assert(is_power_of_2(capacity), #name ": capacity must be a power of 2");
+
+/* Allocation helpers, shared by all the variants */
+#define RING_TYPED_ALLOC(name) \
+static inline struct name *name##_create(void) \
+{ \
+	struct name *r; \
+	if (posix_memalign((void **)&r, CACHE_LINE, sizeof(*r))) \
+		return NULL; \
+	name##_init(r); \
+	return r; \
+} \
+static inline void name##_destroy(struct name *r) \
+{ \
+	free(r); \
+}
+
+/*
+ * One writer/one reader. Same design as RING_F_SPSC: head and tail on
+ * their own cache lines, each side caches the other side index.
+ */
+#define DEFINE_RING(name, type, capacity) \
+RING_TYPED_CHECK(name, capacity) \
+struct name { \
+	unsigned int	head __cacheline_aligned; \
+	unsigned int	tail_cache; \
+	unsigned int	tail __cacheline_aligned; \
+	unsigned int	head_cache; \
+	type		slots[capacity] __cacheline_aligned; \
+}; \
+static inline void name##_init(struct name *r) \
+{ \
+	r->head = r->tail_cache = 0; \
+	r->tail = r->head_cache = 0; \
+} \
+static inline unsigned int name##_count(struct name *r) \
+{ \
+	return READ_ONCE(r->head) - READ_ONCE(r->tail); \
+} \
+static inline int name##_put(struct name *r, const type *elem) \
+{ \
+	unsigned int head = r->head; \
+	if (unlikely(head - r->tail_cache == (capacity))) { \
+		r->tail_cache = smp_load_acquire(&r->tail); \
+		if (head - r->tail_cache == (capacity)) \
+			return -1; \
+	} \
+	r->slots[head & ((capacity) - 1)] = *elem; \
+	smp_store_release(&r->head, head + 1); \
+	return 0; \
+} \
+static inline int name##_get(struct name *r, type *elem) \
+{ \
+	unsigned int tail = r->tail; \
+	if (unlikely(r->head_cache == tail)) { \
+		r->head_cache = smp_load_acquire(&r->head); \
+		if (r->head_cache == tail) \
+			return -1; \
+	} \
+	*elem = r->slots[tail & ((capacity) - 1)]; \
+	smp_store_release(&r->tail, tail + 1); \
+	return 0; \
+} \
+RING_TYPED_ALLOC(name)
+
+/*
+ * Any number of writers/readers. Same design as RING_F_MPMC: a sequence
+ * number per slot, positions claimed with a CAS on head/tail.
+ */
+#define DEFINE_RING_MPMC(name, type, capacity) \
+RING_TYPED_CHECK(name, capacity) \
+struct name##_slot { \
+	unsigned int	seq; \
+	type		elem; \
+}; \
+struct name { \
+	unsigned int		head __cacheline_aligned; \
+	unsigned int		tail __cacheline_aligned; \
+	struct name##_slot	slots[capacity] __cacheline_aligned; \
+}; \
+static inline void name##_init(struct name *r) \
+{ \
+	unsigned int i; \
+	r->head = r->tail = 0; \
+	for (i = 0; i < (capacity); i++) \
+		r->slots[i].seq = i; \
+} \
+static inline unsigned int name##_count(struct name *r) \
+{ \
+	unsigned int used = READ_ONCE(r->head) - READ_ONCE(r->tail); \
+	return used > (capacity) ? (capacity) : used; \
+} \
+static inline int name##_put(struct name *r, const type *elem) \
+{ \
+	struct name##_slot *slot; \
+	unsigned int pos = READ_ONCE(r->head); \
+	int diff; \
+	for (;;) { \
+		slot = &r->slots[pos & ((capacity) - 1)]; \
+		diff = (int)(smp_load_acquire(&slot->seq) - pos); \
+		if (!diff) { \
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, \
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+				break; \
+		} else if (diff < 0) { \
+			return -1; \
+		} else { \
+			pos = READ_ONCE(r->head); \
+		} \
+	} \
+	slot->elem = *elem; \
+	smp_store_release(&slot->seq, pos + 1); \
+	return 0; \
+} \
+static inline int name##_get(struct name *r, type *elem) \
+{ \
+	struct name##_slot *slot; \
+	unsigned int pos = READ_ONCE(r->tail); \
+	int diff; \
+	for (;;) { \
+		slot = &r->slots[pos & ((capacity) - 1)]; \
+		diff = (int)(smp_load_acquire(&slot->seq) - (pos + 1)); \
+		if (!diff) { \
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, \
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+				break; \
+		} else if (diff < 0) { \
+			return -1; \
+		} else { \
+			pos = READ_ONCE(r->tail); \
+		} \
+	} \
+	*elem = slot->elem; \
+	smp_store_release(&slot->seq, pos + (capacity)); \
+	return 0; \
+} \
+RING_TYPED_ALLOC(name)
+
+#endif /* __RING_TYPED_H__ */
@@ -5,26 +5,34 @@
 #include "threads.h"
 
 /*
- * This function will be called by all readers threads.
+ * Map the optional mode argument to ring flags. Return -1 for unknown modes.
+ */
+static int parse_mode(const char *mode, unsigned int *flags)
+{
+	if (!strcmp(mode, "lock"))
+		*flags = 0;
+	else if (!strcmp(mode, "spsc"))
+		*flags = RING_F_SPSC;
+	else if (!strcmp(mode, "mpmc"))
+		*flags = RING_F_MPMC;
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * This function will be called by all readers threads. They stop when the
+ * ring is closed (all writers are done) and there is nothing left in it.
  */
 static void *readers_function(void *data)
 {
-	int w_number;
 	struct struct_t w_struct;
 
-	w_number = *(int *)data;
-	for (;;) {
-			pthread_mutex_lock(&readers_mutex);
-			if (read_messages == w_number * NUM_WRITES) {
-				pthread_mutex_unlock(&readers_mutex);
-				break;
-			}
-			++read_messages;
-			pthread_mutex_unlock(&readers_mutex);
-			while (ring_buffer_get(r_buf, &w_struct));
+	while (!ring_buffer_get_wait(r_buf, &w_struct, NULL)) {
 #ifdef PRINT
-			printf("%-30lu%-30lu%-30s\n", pthread_self(),
-						    w_struct.thread_id, w_struct.msg);
+		printf("%-30lu%-30lu%-30s\n", pthread_self(),
+					    w_struct.thread_id, w_struct.msg);
 #endif
 	}
 
@@ -40,36 +48,547 @@ static void *writers_function(void *data)
 	struct struct_t w_struct;
 
 	w_struct.thread_id = pthread_self();
-	memcpy(w_struct.msg, MSG, MSG_SIZE);
+	strncpy(w_struct.msg, MSG, MSG_SIZE);
 
 	for (i = 0; i < NUM_WRITES; i++) {
-		while (ring_buffer_put(r_buf, &w_struct));
+		ring_buffer_put_wait(r_buf, &w_struct, NULL);
 	}
 
 	return NULL;
 }
 
 
+/*
+ * Benchmark mode
+ *
+ * ./threads -r <readers> -w <writers> [-m mode] [-s ring_size] [-e elem_size]
+ *	     [-b batch] [-n messages] [-d seconds] [-f csv|json] [-T trace_file]
+ *	     [-p none|smt|l3|spread]
+ *
+ * -r, -w, -m, -s, -e and -b take comma separated lists, every combination
+ * is run (sweep) and reported as one CSV line/JSON object.
+ */
+
+static unsigned long long bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Called when the ring is full/empty. Spin a bit, then give the CPU away so
+ * the other side can run even with more threads than cores.
+ */
+static void bench_backoff(unsigned int *fails)
+{
+	if (++(*fails) & 63)
+		cpu_relax();
+	else
+		sched_yield();
+}
+
+/*
+ * Thread side of the start gate: wait until all the threads are created.
+ * Unlike a barrier the gate opens for the threads that exist, a failure to
+ * create the others doesn't leave them blocked.
+ */
+static void bench_ready(struct bench_run *run)
+{
+	pthread_mutex_lock(&run->start_mutex);
+	run->ready++;
+	pthread_cond_broadcast(&run->start_cond);
+	while (!run->go)
+		pthread_cond_wait(&run->start_cond, &run->start_mutex);
+	pthread_mutex_unlock(&run->start_mutex);
+}
+
+/*
+ * Wait for the nr threads created to reach the gate and open it.
+ */
+static void bench_go(struct bench_run *run, unsigned int nr)
+{
+	pthread_mutex_lock(&run->start_mutex);
+	while (run->ready < nr)
+		pthread_cond_wait(&run->start_cond, &run->start_mutex);
+	run->go = 1;
+	pthread_cond_broadcast(&run->start_cond);
+	pthread_mutex_unlock(&run->start_mutex);
+}
+
+static void *bench_writer(void *data)
+{
+	struct bench_run *run = data;
+	struct bench_cfg *cfg = run->cfg;
+	struct bench_hdr *hdr;
+	unsigned long sent = 0;
+	unsigned long long now;
+	unsigned int i, n, k, done, fails = 0;
+	unsigned int id;
+	char *buf;
+
+	id = __atomic_fetch_add(&run->next_writer, 1, __ATOMIC_RELAXED);
+	buf = (char *) calloc(cfg->batch, cfg->elem_size);
+	if (!buf)
+		ON_ERR(errno);
+
+	bench_ready(run);
+	if (!buf)
+		goto out;
+
+	while (!cfg->messages || sent < cfg->messages) {
+		if (READ_ONCE(run->stop))
+			break;
+
+		n = cfg->batch;
+		if (cfg->messages && cfg->messages - sent < n)
+			n = cfg->messages - sent;
+
+		now = bench_now();
+		for (i = 0; i < n; i++) {
+			hdr = (struct bench_hdr *)(buf + i * cfg->elem_size);
+			hdr->tstamp = now;
+			hdr->writer = id;
+			hdr->seq = sent + i;
+		}
+
+		for (done = 0; done < n; done += k) {
+			if (n == 1)
+				k = !ring_buffer_put(run->r_buf, buf);
+			else
+				k = ring_buffer_put_burst(run->r_buf,
+						buf + done * cfg->elem_size,
+						n - done);
+			if (!k) {
+				if (READ_ONCE(run->stop))
+					goto out;
+				bench_backoff(&fails);
+			}
+		}
+		TRACE(TRACE_BENCH_PUT, id, n);
+		sent += n;
+	}
+
+out:
+	free(buf);
+	/*
+	 * acq_rel: the last writer must see every other writer's puts before
+	 * it closes, or a reader may see closed with elements still to come.
+	 */
+	if (__atomic_add_fetch(&run->writers_done, 1, __ATOMIC_ACQ_REL) ==
+	    cfg->writers)
+		ring_buffer_close(run->r_buf);
+	return NULL;
+}
+
+static void *bench_reader(void *data)
+{
+	struct bench_reader *reader = data;
+	struct bench_run *run = reader->run;
+	struct bench_cfg *cfg = run->cfg;
+	unsigned long long now;
+	unsigned int i, k, fails = 0;
+	char *buf;
+
+	buf = (char *) calloc(cfg->batch, cfg->elem_size);
+	if (!buf)
+		ON_ERR(errno);
+
+	bench_ready(run);
+	if (!buf)
+		return NULL;
+
+	for (;;) {
+		if (cfg->batch == 1)
+			k = !ring_buffer_get(run->r_buf, buf);
+		else
+			k = ring_buffer_get_burst(run->r_buf, buf, cfg->batch);
+		if (!k) {
+			if (!ring_buffer_closed(run->r_buf)) {
+				bench_backoff(&fails);
+				continue;
+			}
+			/* writers are gone, take what is left */
+			k = ring_buffer_get_burst(run->r_buf, buf, cfg->batch);
+			if (!k)
+				break;
+		}
+
+		TRACE(TRACE_BENCH_GET, reader, k);
+		now = bench_now();
+		for (i = 0; i < k; i++)
+			hist_add(&reader->lat, now -
+				((struct bench_hdr *)(buf + i * cfg->elem_size))->tstamp);
+		reader->ops += k;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * CPU of the i-th writer/reader. Writers and readers are interleaved in
+ * the placement order (writer 0, reader 0, writer 1, ...) so each pair is
+ * as close as the policy says, the threads without a pair follow.
+ */
+static int bench_cpu(struct bench_cfg *cfg, int reader, unsigned long i)
+{
+	unsigned long pairs, idx;
+
+	pairs = cfg->readers < cfg->writers ? cfg->readers : cfg->writers;
+	idx = i < pairs ? 2 * i + reader : pairs + i;
+
+	return cfg->cpus[idx % cfg->nr_cpus];
+}
+
+static void bench_report(struct bench_cfg *cfg, const char *format,
+			 unsigned long ops, double secs, struct hist *lat,
+			 int first)
+{
+	double rate = secs > 0 ? ops / secs : 0;
+
+	if (!strcmp(format, "json")) {
+		printf("%s{\"mode\": \"%s\", \"readers\": %d, \"writers\": %d, "
+		       "\"ring_size\": %zu, \"elem_size\": %zu, \"batch\": %u, "
+		       "\"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+		       "\"ns_per_op\": %.2f, \"p50_ns\": %lu, \"p99_ns\": %lu, "
+		       "\"p999_ns\": %lu, \"placement\": \"%s\"}",
+		       first ? "" : ",\n",
+		       cfg->mode, cfg->readers, cfg->writers, cfg->ring_size,
+		       cfg->elem_size, cfg->batch, ops, secs, rate,
+		       rate > 0 ? 1e9 / rate : 0,
+		       hist_percentile(lat, 50),
+		       hist_percentile(lat, 99),
+		       hist_percentile(lat, 99.9),
+		       topo_name(cfg->policy));
+		return;
+	}
+
+	if (first)
+		printf("mode,readers,writers,ring_size,elem_size,batch,ops,seconds,"
+		       "ops_per_sec,ns_per_op,p50_ns,p99_ns,p999_ns,placement\n");
+	printf("%s,%d,%d,%zu,%zu,%u,%lu,%.6f,%.0f,%.2f,%lu,%lu,%lu,%s\n",
+	       cfg->mode, cfg->readers, cfg->writers, cfg->ring_size,
+	       cfg->elem_size, cfg->batch, ops, secs, rate,
+	       rate > 0 ? 1e9 / rate : 0,
+	       hist_percentile(lat, 50),
+	       hist_percentile(lat, 99),
+	       hist_percentile(lat, 99.9),
+	       topo_name(cfg->policy));
+}
+
+/*
+ * Run one configuration and report it. Return 0 on success.
+ */
+static int bench_run(struct bench_cfg *cfg, const char *format, int first)
+{
+	struct bench_reader *readers;
+	unsigned long long t0, t1;
+	unsigned long i, ops = 0;
+	struct hist lat;
+	struct timespec ts;
+	struct bench_run run;
+	pthread_attr_t attr, *pattr = NULL;
+	int nr_writers = 0, nr_readers = 0;
+	pthread_t *writers;
+	int err = -1, ret = 0;
+
+	memset(&run, 0, sizeof(run));
+	run.cfg = cfg;
+	run.r_buf = ring_buffer_init_flags(cfg->elem_size, cfg->ring_size,
+					   cfg->flags);
+	if (!run.r_buf)
+		goto out_err;
+
+	if (posix_memalign((void **)&readers, CACHE_LINE,
+			   cfg->readers * sizeof(*readers))) {
+		ON_ERR(ENOMEM);
+		goto out_err_1;
+	}
+	memset(readers, 0, cfg->readers * sizeof(*readers));
+	writers = (pthread_t *) malloc(cfg->writers * sizeof(pthread_t));
+	if (!writers) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+	for (i = 0; i < cfg->readers; i++) {
+		readers[i].run = &run;
+		hist_init(&readers[i].lat);
+	}
+
+	if (pthread_mutex_init(&run.start_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_3;
+	}
+	if (pthread_cond_init(&run.start_cond, NULL)) {
+		ON_ERR(errno);
+		goto out_err_4;
+	}
+
+	/* threads start on their CPU, buffers are allocated there */
+	if (cfg->nr_cpus) {
+		ret = pthread_attr_init(&attr);
+		if (!ret)
+			pattr = &attr;
+	}
+
+	/* pthread functions return the error, they don't set errno */
+	for (; !ret && nr_writers < cfg->writers; nr_writers++) {
+		if (pattr && (ret = topo_attr(pattr, bench_cpu(cfg, 0, nr_writers))))
+			break;
+		ret = pthread_create(&writers[nr_writers], pattr, &bench_writer,
+				     &run);
+		if (ret)
+			break;
+	}
+	for (; !ret && nr_readers < cfg->readers; nr_readers++) {
+		if (pattr && (ret = topo_attr(pattr, bench_cpu(cfg, 1, nr_readers))))
+			break;
+		ret = pthread_create(&readers[nr_readers].tid, pattr,
+				     &bench_reader, &readers[nr_readers]);
+		if (ret)
+			break;
+	}
+	if (pattr)
+		pthread_attr_destroy(pattr);
+	if (ret) {
+		/* nothing to measure, the threads started stop right away */
+		ON_ERR(ret);
+		WRITE_ONCE(run.stop, 1);
+		ring_buffer_close(run.r_buf);
+	}
+
+	bench_go(&run, nr_writers + nr_readers);
+	t0 = bench_now();
+	if (!ret && cfg->duration > 0) {
+		ts.tv_sec = (time_t)cfg->duration;
+		ts.tv_nsec = (long)((cfg->duration - ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		WRITE_ONCE(run.stop, 1);
+	}
+	for (i = 0; i < nr_writers; i++)
+		pthread_join(writers[i], NULL);
+	for (i = 0; i < nr_readers; i++)
+		pthread_join(readers[i].tid, NULL);
+	t1 = bench_now();
+	if (ret) {
+		fprintf(stderr, "%s: %d writers and %d readers started out of "
+			"%d/%d, run stopped\n", cfg->mode, nr_writers, nr_readers,
+			cfg->writers, cfg->readers);
+		goto out_err_5;
+	}
+
+	/* every message of every reader counts the same */
+	hist_init(&lat);
+	for (i = 0; i < cfg->readers; i++) {
+		ops += readers[i].ops;
+		hist_merge(&lat, &readers[i].lat);
+	}
+
+	bench_report(cfg, format, ops, (t1 - t0) / 1e9, &lat, first);
+	err = 0;
+
+out_err_5:
+	pthread_cond_destroy(&run.start_cond);
+out_err_4:
+	pthread_mutex_destroy(&run.start_mutex);
+out_err_3:
+	free(writers);
+out_err_2:
+	free(readers);
+out_err_1:
+	ring_buffer_free(run.r_buf);
+out_err:
+	return err;
+}
+
+/*
+ * Parse a comma separated list of numbers. Return the number of values.
+ */
+static int bench_list(char *arg, unsigned long *values)
+{
+	char *tok;
+	int nr = 0;
+
+	for (tok = strtok(arg, ","); tok && nr < BENCH_LIST;
+	     tok = strtok(NULL, ","))
+		values[nr++] = strtoul(tok, NULL, 10);
+
+	return nr;
+}
+
+static int bench_main(int argc, char **argv)
+{
+	unsigned long readers[BENCH_LIST] = { 1 }, writers[BENCH_LIST] = { 1 };
+	unsigned long sizes[BENCH_LIST] = { 1024 }, elems[BENCH_LIST] = { 64 };
+	unsigned long batches[BENCH_LIST] = { 1 };
+	int nr_r = 1, nr_w = 1, nr_s = 1, nr_e = 1, nr_b = 1, nr_m = 1;
+	int r, w, sz, e, b, m, opt, first = 1, err = 0;
+	char *modes[BENCH_LIST] = { "lock" }, *tok;
+	const char *format = "csv", *trace = NULL;
+	static int cpus[TOPO_MAX_CPUS];
+	struct bench_cfg cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.messages = BENCH_MESSAGES;
+
+	while ((opt = getopt(argc, argv, "r:w:m:s:e:b:n:d:f:T:p:")) != -1) {
+		switch (opt) {
+		case 'r':
+			nr_r = bench_list(optarg, readers);
+			break;
+		case 'w':
+			nr_w = bench_list(optarg, writers);
+			break;
+		case 's':
+			nr_s = bench_list(optarg, sizes);
+			break;
+		case 'e':
+			nr_e = bench_list(optarg, elems);
+			break;
+		case 'b':
+			nr_b = bench_list(optarg, batches);
+			break;
+		case 'm':
+			nr_m = 0;
+			for (tok = strtok(optarg, ","); tok && nr_m < BENCH_LIST;
+			     tok = strtok(NULL, ","))
+				modes[nr_m++] = tok;
+			break;
+		case 'n':
+			cfg.messages = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			cfg.duration = strtod(optarg, NULL);
+			/* run for the given time unless -n is given too */
+			if (cfg.messages == BENCH_MESSAGES)
+				cfg.messages = 0;
+			break;
+		case 'f':
+			format = optarg;
+			if (strcmp(format, "csv") && strcmp(format, "json")) {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'p':
+			if (topo_parse(optarg, &cfg.policy)) {
+				fprintf(stderr, "Unknown placement %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s -r <readers> -w <writers> "
+				"[-m lock,spsc,mpmc] [-s ring_size] [-e elem_size] "
+				"[-b batch] [-n messages] [-d seconds] "
+				"[-f csv|json] [-T trace_file] "
+				"[-p none|smt|l3|spread]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (cfg.policy != TOPO_NONE) {
+		cfg.cpus = cpus;
+		cfg.nr_cpus = topo_order(cfg.policy, cpus, TOPO_MAX_CPUS);
+		if (cfg.nr_cpus <= 0)
+			return -1;
+	}
+
+	if (trace && trace_start(trace))
+		return -1;
+
+	if (!strcmp(format, "json"))
+		printf("[\n");
+
+	for (m = 0; m < nr_m; m++)
+	for (r = 0; r < nr_r; r++)
+	for (w = 0; w < nr_w; w++)
+	for (sz = 0; sz < nr_s; sz++)
+	for (e = 0; e < nr_e; e++)
+	for (b = 0; b < nr_b; b++) {
+		cfg.mode = modes[m];
+		cfg.readers = readers[r];
+		cfg.writers = writers[w];
+		cfg.ring_size = sizes[sz];
+		cfg.elem_size = elems[e];
+		cfg.batch = batches[b] ? batches[b] : 1;
+
+		if (parse_mode(cfg.mode, &cfg.flags)) {
+			fprintf(stderr, "Unknown mode %s\n", cfg.mode);
+			err = -1;
+			goto out;
+		}
+		if ((cfg.flags & RING_F_SPSC) && (cfg.readers != 1 || cfg.writers != 1)) {
+			fprintf(stderr, "Skipping spsc with %d readers, "
+				"%d writers (needs 1, 1)\n",
+				cfg.readers, cfg.writers);
+			continue;
+		}
+		if (cfg.readers < 1 || cfg.writers < 1 ||
+		    cfg.elem_size < sizeof(struct bench_hdr)) {
+			fprintf(stderr, "Need at least one reader/writer and "
+				"elem_size >= %zu\n", sizeof(struct bench_hdr));
+			err = -1;
+			goto out;
+		}
+
+		if (bench_run(&cfg, format, first)) {
+			err = -1;
+			goto out;
+		}
+		first = 0;
+		fflush(stdout);
+	}
+
+	if (!strcmp(format, "json"))
+		printf("\n]\n");
+
+out:
+	if (trace)
+		trace_stop();
+	return err;
+}
+
 int main(int argc, char **argv)
 {
 	int i, r_number, w_number, err = 0;
+	unsigned int flags = 0;
 	pthread_t *writers, *readers;
 
-	r_buf = ring_buffer_init(sizeof(struct struct_t), RING_SIZE);
-	if (!r_buf)
-		return -1;
+	/* Options select the benchmark mode */
+	if (argc > 1 && argv[1][0] == '-')
+		return bench_main(argc, argv);
 
 	/* Get readers/writers number */
 	if (argc < 3) {
 		fprintf(stderr, "Specify readers & writers number.Ex:\n%s\n",
-			"./threads <readers_nr> <writers_nr>");
-		err = -1;
-		goto out_err;
+			"./threads <readers_nr> <writers_nr> [lock|spsc|mpmc]");
+		return -1;
 	}
 
 	r_number = strtol(argv[1], NULL, 10);
 	w_number = strtol(argv[2], NULL, 10);
 
+	if (argc > 3 && parse_mode(argv[3], &flags)) {
+		fprintf(stderr, "Unknown mode %s\n", argv[3]);
+		return -1;
+	}
+	if ((flags & RING_F_SPSC) && (r_number != 1 || w_number != 1)) {
+		fprintf(stderr, "spsc mode needs exactly one reader and one writer\n");
+		return -1;
+	}
+
+	/* sleep instead of spinning when the ring is full/empty */
+	r_buf = ring_buffer_init_flags(sizeof(struct struct_t), RING_SIZE,
+				       flags | RING_F_WAIT);
+	if (!r_buf)
+		return -1;
+
 	/* Create threads */
 	readers = (pthread_t *) malloc(r_number * sizeof(pthread_t));
 	if (!readers) {
@@ -95,7 +614,7 @@ int main(int argc, char **argv)
 		}
 	}
 	for (i = 0; i < r_number; i++) {
-		if (pthread_create(&readers[i], NULL, &readers_function, &w_number)) {
+		if (pthread_create(&readers[i], NULL, &readers_function, NULL)) {
 			ON_ERR(errno);
 			goto out_err_2;
 			/* TODO: Join rest of the threads */
@@ -110,6 +629,8 @@ int main(int argc, char **argv)
 			/* TODO: Join rest of the threads */
 		}
 	}
+	/* all messages are in, readers stop once they got them */
+	ring_buffer_close(r_buf);
 	for (i = 0; i < r_number; i++) {
 		if (pthread_join(readers[i], NULL)) {
 			ON_ERR(errno);
@@ -2,11 +2,17 @@
  * Copyright (C) 2020 Lazar Razvan
  */
 
+#include "time.h"
+#include "sched.h"
+#include "unistd.h"
+#include "getopt.h"
 #include "buffer.h"
+#include "topology.h"
+#include "trace.h"
 
 #define MSG_SIZE	10
 #define	MSG		"Hello"
-#define RING_SIZE	32	/* multiple of 2 (for overflow situations) */
+#define RING_SIZE	32	/* power of 2 (indexes wrap around) */
 #define NUM_WRITES	10	/* number of messages each writer will add */
 
 struct struct_t {
@@ -15,6 +21,51 @@ struct struct_t {
 };
 
 struct ring_buffer *r_buf;
-/* Keep track of all messages and stop when read all */
-pthread_mutex_t	readers_mutex = PTHREAD_MUTEX_INITIALIZER;
-int read_messages;
+
+/* Benchmark mode (./threads -r .. -w ..) defaults */
+#define BENCH_MESSAGES	1000000	/* messages per writer */
+#define BENCH_LIST	16	/* max values in a sweep list */
+
+/* Every benchmark message starts with this header */
+struct bench_hdr {
+	unsigned long long	tstamp;		/* enqueue time (ns) */
+	unsigned int		writer;		/* writer index */
+	unsigned int		seq;		/* message number */
+};
+
+/* One benchmark configuration */
+struct bench_cfg {
+	const char		*mode;		/* lock, spsc, mpmc */
+	unsigned int		flags;		/* ring flags for mode */
+	int			readers;
+	int			writers;
+	size_t			ring_size;
+	size_t			elem_size;
+	unsigned int		batch;		/* elements per put/get call */
+	unsigned long		messages;	/* per writer, 0 = no limit */
+	double			duration;	/* seconds, 0 = no limit */
+	enum topo_policy	policy;		/* thread placement */
+	int			*cpus;		/* placement order (policy) */
+	int			nr_cpus;	/* 0 = no pinning */
+};
+
+/* State shared by the threads of one benchmark run */
+struct bench_run {
+	struct bench_cfg	*cfg;
+	struct ring_buffer	*r_buf;
+	pthread_mutex_t		start_mutex;	/* start gate, see bench_ready */
+	pthread_cond_t		start_cond;
+	unsigned int		ready;		/* threads at the gate */
+	int			go;		/* gate open */
+	unsigned int		next_writer;	/* writer index allocator */
+	unsigned int		writers_done;	/* the last one closes the ring */
+	int			stop;
+};
+
+/* Per reader state, the histograms of all the readers are merged */
+struct bench_reader {
+	pthread_t		tid;
+	struct bench_run	*run;
+	unsigned long		ops;
+	struct hist		lat;		/* latency of every message (ns) */
+} __cacheline_aligned;
@@ -0,0 +1,319 @@
+/* CPU topology and thread placement
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Only the CPUs that are online and in the affinity mask of the process
+ * (taskset, cgroup cpuset) are used. A machine without an L3 (or a sysfs
+ * that doesn't report caches) is one L3 domain per package.
+ *
+ * Affinity masks are per thread, there is no process mask to ask for. The
+ * mask of the main thread (its tid is the pid) is taken the first time the
+ * topology is used and stands for the process mask from then on, so pinned
+ * threads (or later changes) don't shrink it.
+ */
+#define _GNU_SOURCE
+#include "sched.h"
+#include "unistd.h"
+#include "topology.h"
+#include "buffer.h"
+
+struct topo_key {
+	unsigned long long	key;
+	int			cpu;
+};
+
+/* CPUs of the process, see topo_allowed */
+static cpu_set_t topo_mask;
+static int topo_mask_err;
+static pthread_once_t topo_mask_once = PTHREAD_ONCE_INIT;
+
+static const char *topo_names[] = {
+	[TOPO_NONE]	= "none",
+	[TOPO_SMT]	= "smt",
+	[TOPO_L3]	= "l3",
+	[TOPO_SPREAD]	= "spread",
+};
+
+/*
+ * Map a policy name (none, smt, l3, spread) to the policy. Return 0 on
+ * success, -1 for unknown names.
+ */
+int topo_parse(const char *name, enum topo_policy *policy)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(topo_names) / sizeof(*topo_names); i++)
+		if (!strcmp(name, topo_names[i])) {
+			*policy = i;
+			return 0;
+		}
+
+	return -1;
+}
+
+const char *topo_name(enum topo_policy policy)
+{
+	return topo_names[policy];
+}
+
+/*
+ * Read the first line of a sysfs file in buf. Return 0 on success.
+ */
+static int topo_read(const char *path, char *buf, int len)
+{
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(buf, len, f))
+		ret = 0;
+	fclose(f);
+
+	return ret;
+}
+
+/*
+ * First CPU of a CPU list file ("0-3,8-11"), -1 if it can't be read. The
+ * lists are sorted, the first CPU identifies the group.
+ */
+static int topo_first(const char *path)
+{
+	char buf[64];
+
+	if (topo_read(path, buf, sizeof(buf)))
+		return -1;
+
+	return strtol(buf, NULL, 10);
+}
+
+/*
+ * Set in set the CPUs of a CPU list file.
+ */
+static int topo_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096], *p = buf, *end;
+	long lo, hi;
+
+	if (topo_read(path, buf, sizeof(buf)))
+		return -1;
+
+	CPU_ZERO(set);
+	while (*p >= '0' && *p <= '9') {
+		lo = hi = strtol(p, &end, 10);
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (; lo <= hi && lo < TOPO_MAX_CPUS; lo++)
+			CPU_SET(lo, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/* L3 domain of cpu, -1 if sysfs has no L3 for it */
+static int topo_l3(int cpu)
+{
+	char path[128], buf[16];
+	int i;
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), TOPO_SYSFS "/cpu%d/cache/index%d/level",
+			 cpu, i);
+		if (topo_read(path, buf, sizeof(buf)))
+			return -1;
+		if (strtol(buf, NULL, 10) != 3)
+			continue;
+		snprintf(path, sizeof(path),
+			 TOPO_SYSFS "/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+		return topo_first(path);
+	}
+}
+
+static void topo_mask_init(void)
+{
+	/* main thread gone (pthread_exit): the calling thread */
+	if (sched_getaffinity(getpid(), sizeof(topo_mask), &topo_mask) &&
+	    sched_getaffinity(0, sizeof(topo_mask), &topo_mask))
+		topo_mask_err = errno;
+}
+
+/*
+ * Copy in set the CPUs the process may run on. Return 0 on success, -1
+ * with errno set otherwise.
+ */
+static int topo_allowed(cpu_set_t *set)
+{
+	pthread_once(&topo_mask_once, topo_mask_init);
+	if (topo_mask_err) {
+		errno = topo_mask_err;
+		return -1;
+	}
+
+	*set = topo_mask;
+	return 0;
+}
+
+/*
+ * Fill cpus with the usable CPUs and their core/L3. Return how many.
+ */
+static int topo_discover(struct topo_cpu *cpus)
+{
+	cpu_set_t online, allowed;
+	char path[128];
+	int cpu, i, j, nr = 0;
+
+	if (topo_allowed(&allowed))
+		return -1;
+	/* no sysfs (container...): whatever the affinity mask allows */
+	if (topo_list(TOPO_SYSFS "/online", &online))
+		online = allowed;
+
+	for (cpu = 0; cpu < TOPO_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online) || !CPU_ISSET(cpu, &allowed))
+			continue;
+
+		cpus[nr].cpu = cpu;
+		snprintf(path, sizeof(path),
+			 TOPO_SYSFS "/cpu%d/topology/thread_siblings_list", cpu);
+		cpus[nr].core = topo_first(path);
+		if (cpus[nr].core < 0)
+			cpus[nr].core = cpu;
+		cpus[nr].l3 = topo_l3(cpu);
+		if (cpus[nr].l3 < 0) {
+			snprintf(path, sizeof(path),
+				 TOPO_SYSFS "/cpu%d/topology/core_siblings_list", cpu);
+			cpus[nr].l3 = topo_first(path);
+		}
+		if (cpus[nr].l3 < 0)
+			cpus[nr].l3 = 0;
+		nr++;
+	}
+
+	/* ranks, CPUs are sorted by number */
+	for (i = 0; i < nr; i++) {
+		cpus[i].sibling = cpus[i].core_idx = 0;
+		for (j = 0; j < i; j++) {
+			if (cpus[j].core == cpus[i].core)
+				cpus[i].sibling++;
+			else if (cpus[j].l3 == cpus[i].l3 && !cpus[j].sibling)
+				cpus[i].core_idx++;
+		}
+		/* siblings of a core share its rank */
+		if (cpus[i].sibling)
+			for (j = 0; j < i; j++)
+				if (cpus[j].core == cpus[i].core) {
+					cpus[i].core_idx = cpus[j].core_idx;
+					break;
+				}
+	}
+
+	return nr;
+}
+
+static int topo_cmp(const void *a, const void *b)
+{
+	unsigned long long x = ((const struct topo_key *)a)->key;
+	unsigned long long y = ((const struct topo_key *)b)->key;
+
+	return x < y ? -1 : x > y;
+}
+
+#define TOPO_KEY(a, b, c) \
+	(((unsigned long long)(a) << 40) | ((unsigned long long)(b) << 20) | (c))
+
+/*
+ * Write in cpus (at most max) the usable CPUs in the order threads should
+ * be placed on them with policy. Return the number of CPUs, -1 with errno
+ * set on error.
+ */
+int topo_order(enum topo_policy policy, int *cpus, int max)
+{
+	struct topo_cpu *topo;
+	struct topo_key *keys;
+	int i, nr;
+
+	topo = (struct topo_cpu *) malloc(TOPO_MAX_CPUS * sizeof(*topo));
+	keys = (struct topo_key *) malloc(TOPO_MAX_CPUS * sizeof(*keys));
+	if (!topo || !keys) {
+		ON_ERR(ENOMEM);
+		nr = -1;
+		goto out;
+	}
+
+	nr = topo_discover(topo);
+	if (nr < 0) {
+		ON_ERR(errno);
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		keys[i].cpu = topo[i].cpu;
+		switch (policy) {
+		case TOPO_SMT:
+			keys[i].key = TOPO_KEY(topo[i].l3, topo[i].core,
+					       topo[i].sibling);
+			break;
+		case TOPO_L3:
+			keys[i].key = TOPO_KEY(topo[i].l3, topo[i].sibling,
+					       topo[i].core);
+			break;
+		case TOPO_SPREAD:
+			keys[i].key = TOPO_KEY(topo[i].sibling,
+					       topo[i].core_idx, topo[i].l3);
+			break;
+		default:
+			keys[i].key = topo[i].cpu;
+			break;
+		}
+	}
+	qsort(keys, nr, sizeof(*keys), topo_cmp);
+
+	if (nr > max)
+		nr = max;
+	for (i = 0; i < nr; i++)
+		cpus[i] = keys[i].cpu;
+out:
+	free(keys);
+	free(topo);
+	return nr;
+}
+
+/*
+ * Run thread on cpu only. Return 0 on success, an errno value otherwise.
+ */
+int topo_pin(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/*
+ * Let thread run on all the CPUs of the process again. Return 0 on
+ * success, an errno value otherwise.
+ */
+int topo_unpin(pthread_t thread)
+{
+	cpu_set_t set;
+
+	if (topo_allowed(&set))
+		return errno;
+
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/*
+ * Make the threads created with attr start on cpu only (their first
+ * memory accesses already happen there). Return 0 or an errno value.
+ */
+int topo_attr(pthread_attr_t *attr, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
@@ -0,0 +1,43 @@
+/* CPU topology and thread placement
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Reads /sys/devices/system/cpu (SMT siblings, L3 cache domains) and orders
+ * the CPUs the process may run on (the main thread affinity when first
+ * used, see topology.c) following a placement policy. Thread i
+ * of a group goes on cpus[i % nr], so consecutive threads (a writer and
+ * its reader) end up on the same core, in the same L3 or as far as
+ * possible from each other.
+ */
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include "pthread.h"
+
+#ifndef TOPO_SYSFS
+#define TOPO_SYSFS	"/sys/devices/system/cpu"
+#endif
+#define TOPO_MAX_CPUS	1024
+
+enum topo_policy {
+	TOPO_NONE,	/* leave the threads to the scheduler */
+	TOPO_SMT,	/* fill the SMT siblings of a core first */
+	TOPO_L3,	/* one thread per core of an L3 domain first */
+	TOPO_SPREAD,	/* one thread per L3 domain first */
+};
+
+struct topo_cpu {
+	int			cpu;
+	int			core;		/* first CPU of the SMT siblings */
+	int			l3;		/* first CPU sharing the L3 */
+	unsigned int		sibling;	/* rank among the core siblings */
+	unsigned int		core_idx;	/* rank of the core in the L3 */
+};
+
+int topo_parse(const char *name, enum topo_policy *policy);
+const char *topo_name(enum topo_policy policy);
+int topo_order(enum topo_policy policy, int *cpus, int max);
+int topo_pin(pthread_t thread, int cpu);
+int topo_unpin(pthread_t thread);
+int topo_attr(pthread_attr_t *attr, int cpu);
+
+#endif /* __TOPOLOGY_H__ */
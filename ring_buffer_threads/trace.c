@@ -0,0 +1,316 @@
+/* Hot path tracing
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Errors are reported with fprintf, not ON_ERR: ON_ERR is a trace point.
+ */
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "pthread.h"
+#include "sys/syscall.h"
+#include "trace.h"
+
+#define TRACE_ERR(x) \
+	fprintf(stderr, "%s [%d: %s\n", __func__, (x), strerror(x))
+
+int trace_on;
+__thread struct trace_thread *trace_self
+	__attribute__((tls_model("initial-exec")));
+
+/* Threads that ever traced, drainer state */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_thread *trace_threads;
+static pthread_t trace_drainer;
+static int trace_fd = -1;
+static int trace_stopping;
+/* a thread that failed to get a buffer doesn't retry on every event */
+static __thread int trace_failed;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+/* destructor marks the buffer of an exiting thread dead */
+static pthread_key_t trace_key;
+static int trace_key_err;
+
+static const char *trace_names[] = {
+	[TRACE_ERROR]		= "error",
+	[TRACE_RING_PUT]	= "ring_put",
+	[TRACE_RING_GET]	= "ring_get",
+	[TRACE_PIPE_READ]	= "pipe_read",
+	[TRACE_PIPE_WRITE]	= "pipe_write",
+	[TRACE_BENCH_PUT]	= "bench_put",
+	[TRACE_BENCH_GET]	= "bench_get",
+};
+
+const char *trace_name(unsigned int id)
+{
+	if (id < sizeof(trace_names) / sizeof(*trace_names) && trace_names[id])
+		return trace_names[id];
+
+	return "user";
+}
+
+/*
+ * The thread exits: it won't write its ring anymore, the drainer frees it
+ * once it is empty. Trace points in later destructors are dropped.
+ */
+static void trace_thread_exit(void *arg)
+{
+	struct trace_thread *thread = arg;
+
+	trace_self = NULL;
+	trace_failed = 1;
+	smp_store_release(&thread->dead, 1);
+}
+
+static void trace_fork_prepare(void);
+static void trace_fork_parent(void);
+static void trace_fork_child(void);
+
+static void trace_init_once(void)
+{
+	pthread_atfork(trace_fork_prepare, trace_fork_parent, trace_fork_child);
+	trace_key_err = pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+/*
+ * First event of the calling thread: give it a ring and make it visible
+ * to the drainer.
+ */
+struct trace_thread *trace_thread_init(void)
+{
+	struct trace_thread *thread;
+
+	if (trace_failed)
+		return NULL;
+
+	pthread_once(&trace_once, trace_init_once);
+	if (trace_key_err) {
+		trace_failed = 1;
+		TRACE_ERR(trace_key_err);
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&thread, CACHE_LINE, sizeof(*thread))) {
+		trace_failed = 1;
+		TRACE_ERR(ENOMEM);
+		return NULL;
+	}
+	trace_ring_init(&thread->ring);
+	thread->dropped = 0;
+	thread->tid = syscall(SYS_gettid);
+	thread->dead = 0;
+
+	errno = pthread_setspecific(trace_key, thread);
+	if (errno) {
+		trace_failed = 1;
+		TRACE_ERR(errno);
+		free(thread);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&trace_mutex);
+	thread->next = trace_threads;
+	trace_threads = thread;
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_self = thread;
+	return thread;
+}
+
+/*
+ * Write all of buf, the file has no user space buffer a forked child
+ * could flush a second time.
+ */
+static int trace_write(const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(trace_fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Move the events of all the threads to the file, free the buffers of the
+ * threads that exited once they are empty. Return the number of events
+ * written.
+ */
+static unsigned long trace_drain(void)
+{
+	static struct trace_event events[TRACE_RING_SIZE];
+	struct trace_thread *thread, **link;
+	struct trace_chunk chunk;
+	unsigned long total = 0;
+	int dead;
+
+	pthread_mutex_lock(&trace_mutex);
+	for (link = &trace_threads; (thread = *link); ) {
+		/* before the ring: all the events of a dead thread are in */
+		dead = smp_load_acquire(&thread->dead);
+		for (chunk.count = 0; chunk.count < TRACE_RING_SIZE; chunk.count++)
+			if (trace_ring_get(&thread->ring, &events[chunk.count]))
+				break;
+
+		if (chunk.count) {
+			chunk.tid = thread->tid;
+			chunk.dropped = READ_ONCE(thread->dropped);
+			if (trace_write(&chunk, sizeof(chunk)) ||
+			    trace_write(events, chunk.count * sizeof(*events)))
+				TRACE_ERR(errno);
+			total += chunk.count;
+		}
+
+		if (dead && !trace_ring_count(&thread->ring)) {
+			*link = thread->next;
+			free(thread);
+		} else {
+			link = &thread->next;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	return total;
+}
+
+static void *trace_drainer_function(void *arg)
+{
+	while (!READ_ONCE(trace_stopping))
+		if (!trace_drain())
+			usleep(TRACE_DRAIN_US);
+
+	return NULL;
+}
+
+/*
+ * trace_clock ticks per second, measured against CLOCK_MONOTONIC_RAW.
+ */
+static unsigned long long trace_clock_hz(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec t0, t1, sleep = { 0, 10000000 };
+	unsigned long long c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = trace_clock();
+	nanosleep(&sleep, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = trace_clock();
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	return (c1 - c0) * 1000000000ULL / ns;
+#else
+	return 1000000000ULL;
+#endif
+}
+
+/*
+ * A forked child has no drainer: it doesn't record and leaves the file
+ * to the parent. trace_mutex is held over fork so the child gets it
+ * unlocked.
+ */
+static void trace_fork_prepare(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+}
+
+static void trace_fork_parent(void)
+{
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_fork_child(void)
+{
+	pthread_mutex_unlock(&trace_mutex);
+	if (trace_fd == -1)
+		return;
+
+	WRITE_ONCE(trace_on, 0);
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/*
+ * Start recording the trace points in path (truncated). Return 0 on
+ * success, -1 with errno set otherwise (EBUSY if already started).
+ */
+int trace_start(const char *path)
+{
+	struct trace_thread *thread, **link;
+	struct trace_file_hdr hdr;
+	struct trace_event ev;
+	int dead;
+
+	if (trace_fd != -1) {
+		errno = EBUSY;
+		return -1;
+	}
+	pthread_once(&trace_once, trace_init_once);
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd == -1)
+		return -1;
+
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.tsc_hz = trace_clock_hz();
+	if (trace_write(&hdr, sizeof(hdr)))
+		goto out_err;
+
+	/* events left from a previous trace don't belong to this one, the
+	 * threads that exited since can go
+	 */
+	pthread_mutex_lock(&trace_mutex);
+	for (link = &trace_threads; (thread = *link); ) {
+		dead = smp_load_acquire(&thread->dead);
+		while (!trace_ring_get(&thread->ring, &ev))
+			;
+		if (dead) {
+			*link = thread->next;
+			free(thread);
+		} else {
+			link = &thread->next;
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_stopping = 0;
+	errno = pthread_create(&trace_drainer, NULL, trace_drainer_function, NULL);
+	if (errno)
+		goto out_err;
+
+	smp_store_release(&trace_on, 1);
+	return 0;
+out_err:
+	close(trace_fd);
+	trace_fd = -1;
+	return -1;
+}
+
+/*
+ * Stop recording, write the events left and close the file.
+ */
+void trace_stop(void)
+{
+	if (trace_fd == -1)
+		return;
+
+	WRITE_ONCE(trace_on, 0);
+	WRITE_ONCE(trace_stopping, 1);
+	pthread_join(trace_drainer, NULL);
+
+	trace_drain();
+	if (close(trace_fd))
+		TRACE_ERR(errno);
+	trace_fd = -1;
+}
@@ -0,0 +1,112 @@
+/* Hot path tracing
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Every thread writes fixed size, TSC stamped events in its own lock free
+ * ring (a DEFINE_RING one writer/one reader ring), a background thread
+ * drains all the rings into a compact binary file (trace_dump prints it).
+ * An event costs a clock read and a few stores, a full ring drops the
+ * event (counted) instead of slowing the traced thread down.
+ *
+ * Trace points (TRACE, trace_point.h) are compiled in only with
+ * -DRING_TRACE and record only between trace_start and trace_stop.
+ */
+#ifndef __RING_TRACE_H__
+#define __RING_TRACE_H__
+
+#include "time.h"
+#include "ring_typed.h"
+
+#define TRACE_RING_SIZE		16384	/* events per thread (power of 2) */
+#define TRACE_DRAIN_US		100	/* drainer sleep when rings are empty */
+#define TRACE_MAGIC		0x43525452	/* "RTRC" */
+#define TRACE_VERSION		1
+
+/* Event ids, a0/a1 meaning in comments */
+enum trace_id {
+	TRACE_ERROR,		/* errno, __LINE__ (ON_ERR) */
+	TRACE_RING_PUT,		/* ring, 0 or 1 (FULL) */
+	TRACE_RING_GET,		/* ring, 0 or 1 (EMPTY) */
+	TRACE_PIPE_READ,	/* fd, bytes */
+	TRACE_PIPE_WRITE,	/* fd, bytes */
+	TRACE_BENCH_PUT,	/* writer, elements */
+	TRACE_BENCH_GET,	/* reader, elements */
+	TRACE_USER = 64,	/* first id free for applications */
+};
+
+struct trace_event {
+	unsigned long long	tsc;		/* trace_clock */
+	unsigned int		id;		/* enum trace_id */
+	unsigned int		cpu;		/* reserved */
+	unsigned long long	a0;
+	unsigned long long	a1;
+};
+
+DEFINE_RING(trace_ring, struct trace_event, TRACE_RING_SIZE)
+
+/* Per thread trace buffer, freed by the drainer once the thread exited and
+ * its events are written
+ */
+struct trace_thread {
+	struct trace_ring	ring;
+	unsigned long		dropped;	/* events lost, ring FULL */
+	int			tid;
+	int			dead;		/* thread exited, no more events */
+	struct trace_thread	*next;		/* all the threads */
+};
+
+/*
+ * Binary file: a struct trace_file_hdr, then chunks. A chunk is a struct
+ * trace_chunk followed by count events of thread tid, in order.
+ */
+struct trace_file_hdr {
+	unsigned int		magic;
+	unsigned int		version;
+	unsigned long long	tsc_hz;		/* trace_clock ticks per second */
+};
+
+struct trace_chunk {
+	int			tid;
+	unsigned int		count;
+	unsigned long long	dropped;	/* events lost by tid so far */
+};
+
+extern int trace_on;
+extern __thread struct trace_thread *trace_self
+	__attribute__((tls_model("initial-exec")));
+
+struct trace_thread *trace_thread_init(void);
+int trace_start(const char *path);
+void trace_stop(void);
+const char *trace_name(unsigned int id);
+
+static inline unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void __trace(unsigned int id, unsigned long long a0,
+			   unsigned long long a1)
+{
+	struct trace_thread *thread = trace_self;
+	struct trace_event ev;
+
+	if (unlikely(!thread) && !(thread = trace_thread_init()))
+		return;
+
+	ev.tsc = trace_clock();
+	ev.id = id;
+	ev.cpu = 0;
+	ev.a0 = a0;
+	ev.a1 = a1;
+	if (unlikely(trace_ring_put(&thread->ring, &ev)))
+		WRITE_ONCE(thread->dropped, thread->dropped + 1);
+}
+
+#endif /* __RING_TRACE_H__ */
@@ -0,0 +1,94 @@
+/* Print a trace file written by trace_start/trace_stop
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ *	$ ./trace_dump trace.bin
+ *
+ * One line per event: time (ns since the first event of the file), thread
+ * id, event name, arguments. Events are grouped by drain chunk, in order
+ * inside a thread. A summary per event follows.
+ */
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "trace.h"
+
+#define TRACE_IDS	256
+#define TRACE_TIDS	1024	/* threads with a dropped count */
+
+/* dropped is cumulative per thread, keep the last value of every tid */
+static int tids[TRACE_TIDS];
+static unsigned long long tid_dropped[TRACE_TIDS];
+static unsigned int nr_tids;
+
+static void trace_dropped(int tid, unsigned long long dropped)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_tids; i++)
+		if (tids[i] == tid)
+			break;
+	if (i == TRACE_TIDS)
+		return;
+	if (i == nr_tids)
+		tids[nr_tids++] = tid;
+	tid_dropped[i] = dropped;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long count[TRACE_IDS] = { 0 };
+	unsigned long long first = 0, dropped = 0;
+	struct trace_file_hdr hdr;
+	struct trace_chunk chunk;
+	struct trace_event ev;
+	unsigned int i;
+	double ns;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+		return -1;
+	}
+
+	f = fopen(argv[1], "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+	    hdr.version != TRACE_VERSION || !hdr.tsc_hz) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return -1;
+	}
+	ns = 1e9 / hdr.tsc_hz;
+
+	while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+		for (i = 0; i < chunk.count; i++) {
+			if (fread(&ev, sizeof(ev), 1, f) != 1) {
+				fprintf(stderr, "%s: truncated\n", argv[1]);
+				return -1;
+			}
+			if (!first)
+				first = ev.tsc;
+			printf("%16.0f %8d %-12s %#llx %llu\n",
+			       (double)(long long)(ev.tsc - first) * ns,
+			       chunk.tid, trace_name(ev.id), ev.a0, ev.a1);
+			count[ev.id < TRACE_IDS ? ev.id : TRACE_IDS - 1]++;
+		}
+		trace_dropped(chunk.tid, chunk.dropped);
+	}
+
+	for (i = 0; i < nr_tids; i++)
+		dropped += tid_dropped[i];
+
+	printf("\n%-12s %s\n", "event", "count");
+	for (i = 0; i < TRACE_IDS; i++)
+		if (count[i])
+			printf("%-12s %lu\n", trace_name(i), count[i]);
+	printf("dropped      %llu\ntsc %llu Hz\n", dropped, hdr.tsc_hz);
+
+	fclose(f);
+	return 0;
+}
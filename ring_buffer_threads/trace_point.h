@@ -0,0 +1,25 @@
+/* Trace points
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * TRACE(id, a0, a1) records an event (see trace.h) when built with
+ * -DRING_TRACE. Otherwise it compiles to nothing and this header pulls in
+ * nothing, so any code may keep its trace points without depending on the
+ * trace library.
+ */
+#ifndef __RING_TRACE_POINT_H__
+#define __RING_TRACE_POINT_H__
+
+#ifdef RING_TRACE
+#include "trace.h"
+
+#define TRACE(id, a0, a1) \
+do { \
+	if (unlikely(READ_ONCE(trace_on))) \
+		__trace((id), (unsigned long long)(a0), (unsigned long long)(a1)); \
+} while (0)
+#else
+/* arguments never evaluated, still used for -Wunused */
+#define TRACE(id, a0, a1)	do { if (0) { (void)(a0); (void)(a1); } } while (0)
+#endif
+
+#endif /* __RING_TRACE_POINT_H__ */
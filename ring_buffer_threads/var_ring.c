@@ -0,0 +1,276 @@
+/* Variable length ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ */
+
+#include "unistd.h"
+#include "var_ring.h"
+#include "mirror.h"
+
+#define REC_HDR		sizeof(struct var_rec)
+#define REC_SIZE(len)	ALIGN(REC_HDR + (len), VAR_RING_ALIGN)
+
+static inline struct var_rec *var_rec_at(struct var_ring *v_ring, size_t pos)
+{
+	return (struct var_rec *)(v_ring->data + (pos & v_ring->mask));
+}
+
+static inline void var_ring_lock(struct var_ring *v_ring, pthread_mutex_t *mutex)
+{
+#ifdef MULTI_THREADING
+	if (!(v_ring->flags & RING_F_SPSC))
+		pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline void var_ring_unlock(struct var_ring *v_ring, pthread_mutex_t *mutex)
+{
+#ifdef MULTI_THREADING
+	if (!(v_ring->flags & RING_F_SPSC))
+		pthread_mutex_unlock(mutex);
+#endif
+}
+
+#ifdef MULTI_THREADING
+#define W_MUTEX(v)	(&(v)->w_mutex)
+#define R_MUTEX(v)	(&(v)->r_mutex)
+#else
+#define W_MUTEX(v)	NULL
+#define R_MUTEX(v)	NULL
+#endif
+
+/*
+ * Init a variable length ring buffer.
+ *
+ * @size:	Size of the buffer in bytes (power of 2, at least 64, at least
+ *		the page size with RING_F_MIRROR)
+ * @flags:	RING_F_SPSC for one writer/one reader without locks,
+ *		RING_F_MIRROR for records that never wrap
+ */
+struct var_ring *var_ring_init(size_t size, unsigned int flags)
+{
+	struct var_ring *v_ring;
+	size_t arena;
+
+	if (!is_power_of_2(size) || size < CACHE_LINE ||
+	    ((flags & RING_F_MIRROR) && size < sysconf(_SC_PAGESIZE))) {
+		ON_ERR(EINVAL);
+		goto out_err;
+	}
+
+	arena = (flags & RING_F_MIRROR) ? 0 : size;
+	if (posix_memalign((void **)&v_ring, CACHE_LINE, sizeof(*v_ring) + arena)) {
+		ON_ERR(ENOMEM);
+		goto out_err;
+	}
+
+	v_ring->data = v_ring->arena;
+	v_ring->max_len = size / 2 - REC_HDR;
+	if (flags & RING_F_MIRROR) {
+		v_ring->data = mirror_map(size);
+		if (!v_ring->data)
+			goto out_err_1;
+		v_ring->max_len = size - REC_HDR;
+	}
+
+	v_ring->size = size;
+	v_ring->mask = size - 1;
+	v_ring->flags = flags;
+	v_ring->head = v_ring->tail_cache = v_ring->reserved = 0;
+	v_ring->tail = v_ring->head_cache = 0;
+#ifdef MULTI_THREADING
+	if (pthread_mutex_init(&v_ring->w_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_2;
+	}
+	if (pthread_mutex_init(&v_ring->r_mutex, NULL)) {
+		ON_ERR(errno);
+		goto out_err_3;
+	}
+#endif
+
+	return v_ring;
+#ifdef MULTI_THREADING
+out_err_3:
+	pthread_mutex_destroy(&v_ring->w_mutex);
+out_err_2:
+	if (flags & RING_F_MIRROR)
+		mirror_unmap(v_ring->data, size);
+#endif
+out_err_1:
+	free(v_ring);
+out_err:
+	return NULL;
+}
+
+/*
+ * Free a variable length ring buffer.
+ */
+void var_ring_free(struct var_ring *v_ring)
+{
+	if (v_ring) {
+#ifdef MULTI_THREADING
+		if (pthread_mutex_destroy(&v_ring->w_mutex))
+			ON_ERR(errno);
+		if (pthread_mutex_destroy(&v_ring->r_mutex))
+			ON_ERR(errno);
+#endif
+		if (v_ring->flags & RING_F_MIRROR)
+			mirror_unmap(v_ring->data, v_ring->size);
+		free(v_ring);
+	}
+}
+
+/*
+ * Reserve room for a record of len bytes and return the address of its
+ * payload, the caller fills it and calls var_ring_commit. If there is not
+ * enough room, NULL is returned (errno EMSGSIZE if len can never fit).
+ *
+ * Writers are serialized (w_mutex held) until var_ring_commit.
+ */
+void *var_ring_reserve(struct var_ring *v_ring, size_t len)
+{
+	size_t head, need, to_end, total;
+	struct var_rec *rec, *pad;
+
+	if (len > v_ring->max_len) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	var_ring_lock(v_ring, W_MUTEX(v_ring));
+
+	head = v_ring->head;
+	need = REC_SIZE(len);
+	to_end = v_ring->size - (head & v_ring->mask);
+	/* mirrored, the record may run past the end of the ring */
+	if (v_ring->flags & RING_F_MIRROR)
+		to_end = need;
+	total = need <= to_end ? need : to_end + need;
+
+	if (v_ring->size - (head - v_ring->tail_cache) < total) {
+		v_ring->tail_cache = smp_load_acquire(&v_ring->tail);
+		if (v_ring->size - (head - v_ring->tail_cache) < total) {
+			var_ring_unlock(v_ring, W_MUTEX(v_ring));
+			return NULL;
+		}
+	}
+
+	rec = var_rec_at(v_ring, head);
+	if (need > to_end) {
+		/* skip the end of the ring, record starts at offset 0 */
+		pad = rec;
+		pad->len = to_end - REC_HDR;
+		pad->flags = VAR_REC_PAD;
+		rec = var_rec_at(v_ring, 0);
+	}
+	rec->len = len;
+	rec->flags = 0;
+	v_ring->reserved = total;
+
+	return rec + 1;
+}
+
+/*
+ * Publish the record returned by var_ring_reserve.
+ */
+void var_ring_commit(struct var_ring *v_ring)
+{
+	smp_store_release(&v_ring->head, v_ring->head + v_ring->reserved);
+	var_ring_unlock(v_ring, W_MUTEX(v_ring));
+}
+
+/*
+ * Return the payload address of the oldest record and its length in *len,
+ * the caller reads it in place and calls var_ring_release. If the buffer is
+ * EMPTY, NULL is returned.
+ *
+ * Readers are serialized (r_mutex held) until var_ring_release.
+ */
+void *var_ring_peek(struct var_ring *v_ring, size_t *len)
+{
+	struct var_rec *rec;
+	size_t tail;
+
+	var_ring_lock(v_ring, R_MUTEX(v_ring));
+
+	for (;;) {
+		tail = v_ring->tail;
+		if (v_ring->head_cache == tail) {
+			v_ring->head_cache = smp_load_acquire(&v_ring->head);
+			if (v_ring->head_cache == tail) {
+				var_ring_unlock(v_ring, R_MUTEX(v_ring));
+				return NULL;
+			}
+		}
+
+		rec = var_rec_at(v_ring, tail);
+		if (!(rec->flags & VAR_REC_PAD))
+			break;
+		/* padding, give the end of the ring back to the writer */
+		smp_store_release(&v_ring->tail, tail + REC_HDR + rec->len);
+	}
+
+	*len = rec->len;
+	return rec + 1;
+}
+
+/*
+ * Give back to the writers the record returned by var_ring_peek.
+ */
+void var_ring_release(struct var_ring *v_ring)
+{
+	size_t tail = v_ring->tail;
+
+	smp_store_release(&v_ring->tail,
+			  tail + REC_SIZE(var_rec_at(v_ring, tail)->len));
+	var_ring_unlock(v_ring, R_MUTEX(v_ring));
+}
+
+/*
+ * Add a record of len bytes in ring buffer.
+ *
+ * If the buffer is FULL, -1 is returned and the record is not added (errno
+ * EMSGSIZE if len is larger than half of the ring, the whole ring with
+ * RING_F_MIRROR). On success, 0 is returned.
+ */
+int var_ring_put(struct var_ring *v_ring, const void *elem, size_t len)
+{
+	void *payload;
+
+	payload = var_ring_reserve(v_ring, len);
+	if (!payload)
+		return -1;
+
+	memcpy(payload, elem, len);
+	var_ring_commit(v_ring);
+
+	return 0;
+}
+
+/*
+ * Extract a record from ring buffer into elem (len bytes available).
+ *
+ * Return the record length on success. If the buffer is EMPTY, -1 is
+ * returned. If the record is larger than len, -1 is returned with errno
+ * EMSGSIZE and the record stays in the ring.
+ */
+ssize_t var_ring_get(struct var_ring *v_ring, void *elem, size_t len)
+{
+	size_t rec_len;
+	void *payload;
+
+	payload = var_ring_peek(v_ring, &rec_len);
+	if (!payload)
+		return -1;
+
+	if (rec_len > len) {
+		var_ring_unlock(v_ring, R_MUTEX(v_ring));
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	memcpy(elem, payload, rec_len);
+	var_ring_release(v_ring);
+
+	return rec_len;
+}
@@ -0,0 +1,69 @@
+/* Variable length ring buffer
+ * Copyright (C) 2020 Lazar Razvan
+ *
+ * Byte oriented ring where every element is a length prefixed record. The
+ * memory used by an element is its size (plus an 8 byte header, aligned to
+ * 8 bytes) instead of the size of the largest one.
+ */
+#ifndef __VAR_RING_H__
+#define __VAR_RING_H__
+
+#include "sys/types.h"
+#include "buffer.h"
+
+#define VAR_RING_ALIGN	8		/* record alignment */
+#define VAR_REC_PAD	0x1		/* record only fills the end of ring */
+
+/* Record header, the payload follows it */
+struct var_rec {
+	unsigned int		len;		/* payload length */
+	unsigned int		flags;		/* VAR_REC_* */
+};
+
+/*
+ * Head and tail are free running byte offsets. A record that doesn't fit
+ * before the end of the ring is preceded by a padding record covering the
+ * rest of the ring and written at offset 0, so the payload is always
+ * contiguous. Because of that a record can use at most half of the ring.
+ *
+ * With RING_F_MIRROR the records are in a mirror_map mapping instead: the
+ * bytes after the end of the ring are the ones at its start, a record is
+ * contiguous wherever it starts, there is no padding and a record can use
+ * the whole ring.
+ *
+ * By default (MULTI_THREADING) writers are serialized by w_mutex and readers
+ * by r_mutex, a writer and a reader never take the same lock. RING_F_SPSC
+ * removes both locks (one writer/one reader).
+ */
+struct var_ring {
+	size_t			size;		/* bytes, power of 2 */
+	size_t			mask;		/* size - 1 */
+	size_t			max_len;	/* largest payload accepted */
+	unsigned int		flags;		/* RING_F_SPSC, RING_F_MIRROR */
+	char			*data;		/* records (arena or mirror) */
+#ifdef MULTI_THREADING
+	pthread_mutex_t		w_mutex;	/* synchronize writers */
+	pthread_mutex_t		r_mutex;	/* synchronize readers */
+#endif
+	/* producer side */
+	size_t			head __cacheline_aligned;
+	size_t			tail_cache;	/* producer copy of tail */
+	size_t			reserved;	/* bytes of pending reservation */
+	/* consumer side */
+	size_t			tail __cacheline_aligned;
+	size_t			head_cache;	/* consumer copy of head */
+	/* records, unless RING_F_MIRROR */
+	char			arena[] __cacheline_aligned;
+};
+
+struct var_ring *var_ring_init(size_t size, unsigned int flags);
+void var_ring_free(struct var_ring *v_ring);
+int var_ring_put(struct var_ring *v_ring, const void *elem, size_t len);
+ssize_t var_ring_get(struct var_ring *v_ring, void *elem, size_t len);
+/* Zero copy */
+void *var_ring_reserve(struct var_ring *v_ring, size_t len);
+void var_ring_commit(struct var_ring *v_ring);
+void *var_ring_peek(struct var_ring *v_ring, size_t *len);
+void var_ring_release(struct var_ring *v_ring);
+
+#endif /* __VAR_RING_H__ */